@@ -0,0 +1,688 @@
+/* bench.c */
+/* Copyright (c) 2026 J. M. Spivey */
+
+/* Benchmarks for the kernel and drivers.  The results are printed on
+the serial port as lines of the form 'name value unit', so they can be
+collected and compared from one commit to the next.  The program runs
+on either board, and also on QEMU's emulation of V1 with
+
+    qemu-system-arm -M microbit -nographic -kernel bench.elf
+
+QEMU has no radio, and its I2C is only a stub, so the radio and I2C
+tests give up after a timeout and report 'none'.  Times from QEMU are
+interesting only for comparing one version of the code with another.
+
+Timings use timer_micros(), and on V2 also the DWT cycle counter.
+Most tests perform N = 1000 operations, so the total time in
+microseconds is also the time per operation in nanoseconds. */
+
+#include "microbian.h"
+#include "hardware.h"
+#include "lib.h"
+#include <string.h>
+
+#define N 1000                  /* Operations per test */
+
+/* The sendrec_t test is repeated with NSLEEP other processes waiting
+in receive_t(), so the kernel's heap of timeouts is five levels deep.
+Together with the drivers and helpers, that is nearly as many
+processes as the kernel allows. */
+#ifndef NSLEEP
+#define NSLEEP 16               /* Processes with timeouts armed */
+#endif
+
+#define _STR(x) #x
+#define STR(x) _STR(x)
+
+/* Message types for the helper processes */
+#define GO 16                   /* Start a test */
+#define DONE 17                 /* Test finished */
+#define ECHO 18                 /* Ping-pong */
+#define WAKE 19                 /* End a long timeout */
+
+/* RESULTS */
+
+/* Results are saved and printed at the end, so the serial output
+doesn't disturb later tests. */
+
+#define MAX_RESULTS 40
+
+static struct {
+    char *name;                 /* Name of the test */
+    unsigned value;             /* Measured value */
+    char *unit;                 /* Units, or NULL if no result */
+} result[MAX_RESULTS];
+
+static int n_results = 0;
+
+/* record -- save a result */
+static void record(char *name, unsigned value, char *unit)
+{
+    if (n_results >= MAX_RESULTS)
+        panic("Too many results");
+    result[n_results].name = name;
+    result[n_results].value = value;
+    result[n_results].unit = unit;
+    n_results++;
+}
+
+/* show_results -- print and discard the saved results */
+static void show_results(void)
+{
+    for (int i = 0; i < n_results; i++) {
+        if (result[i].unit == NULL)
+            printf("%s none\n", result[i].name);
+        else
+            printf("%s %u %s\n", result[i].name,
+                   result[i].value, result[i].unit);
+    }
+    n_results = 0;
+}
+
+
+/* TIMING */
+
+static unsigned start_us;       /* Start time of test (usec) */
+#ifdef UBIT_V2
+static unsigned start_cyc;      /* Start time of test (cycles) */
+#endif
+
+/* begin -- start timing a test */
+static void begin(void)
+{
+#ifdef UBIT_V2
+    start_cyc = DWT_CYCCNT;
+#endif
+    start_us = timer_micros();
+}
+
+/* elapsed -- time in usec since begin() */
+static unsigned elapsed(void)
+{
+    return timer_micros() - start_us;
+}
+
+/* finish -- record time per operation for n operations */
+static void finish(char *name, int n)
+{
+#ifdef UBIT_V2
+    unsigned cyc = DWT_CYCCNT - start_cyc;
+#endif
+    unsigned us = elapsed();
+
+    record(name, us * 1000 / n, "ns");
+#ifdef UBIT_V2
+    record(name, cyc / n, "cycles");
+#endif
+}
+
+/* rate -- bytes per second */
+static unsigned rate(unsigned bytes, unsigned us)
+{
+    if (us == 0) us = 1;
+    return (unsigned long long) bytes * 1000000 / us;
+}
+
+/* finish_rate -- record throughput in bytes per second */
+static void finish_rate(char *name, unsigned bytes)
+{
+    record(name, rate(bytes, elapsed()), "bytes/s");
+}
+
+
+/* HELPER PROCESSES */
+
+/* Processes cannot be started once the scheduler is running, so
+init() starts all the helpers, and they wait for a GO message. */
+
+static int BENCH, YIELDER, IRQ, TIMED, I2CTEST, RADIOTEST;
+static int SERVER[NPRIO];
+static int SLEEPER[NSLEEP];
+
+/* yielder -- partner for the yield test */
+static void yielder(int arg)
+{
+    while (1) {
+        receive(GO, NULL);
+        for (int i = 0; i < N; i++) yield();
+        send_msg(BENCH, DONE);
+    }
+}
+
+/* server -- echo messages at a given priority */
+static void server(int prio)
+{
+    message m;
+
+    priority(prio);
+
+    while (1) {
+        receive(ANY, &m);
+        switch (m.type) {
+        case ECHO:
+            send_msg(m.sender, ECHO);
+            break;
+        case REQUEST:
+            send_msg(m.sender, REPLY);
+            break;
+        default:
+            badmesg(m.type);
+        }
+    }
+}
+
+/* timed_server -- answer requests using receive_t */
+static void timed_server(int arg)
+{
+    message m;
+
+    while (1) {
+        receive_t(ANY, &m, 60000);
+        if (m.type == REQUEST)
+            send_msg(m.sender, REPLY);
+    }
+}
+
+/* sleeper -- wait with a long timeout when told to */
+static void sleeper(int arg)
+{
+    while (1) {
+        receive(GO, NULL);
+        receive_t(WAKE, NULL, 60000);
+    }
+}
+
+static volatile unsigned irq_time; /* Time the interrupt task ran */
+static volatile unsigned irq_count; /* Number of interrupts handled */
+
+/* irq_task -- handler for software interrupt */
+static void irq_task(int arg)
+{
+    connect(SWI0_IRQ);
+    enable_irq(SWI0_IRQ);
+
+    while (1) {
+        receive(INTERRUPT, NULL);
+#ifdef UBIT_V2
+        irq_time = DWT_CYCCNT;
+#else
+        irq_time = timer_micros();
+#endif
+        irq_count++;
+        enable_irq(SWI0_IRQ);
+    }
+}
+
+#define NI2C 100
+
+/* i2c_test -- time I2C probes of the accelerometer */
+static void i2c_test(int arg)
+{
+    unsigned t0;
+    int addr, status;
+
+    receive(GO, NULL);
+
+    /* Find the accelerometer: see accel.c */
+    addr = 0x1d;
+    if (i2c_probe(I2C_INTERNAL, addr) != OK) {
+        addr = 0x19;
+        if (i2c_probe(I2C_INTERNAL, addr) != OK) {
+            send_int(BENCH, DONE, 0);
+            return;
+        }
+    }
+
+    t0 = timer_micros();
+    for (int i = 0; i < NI2C; i++) {
+        status = i2c_probe(I2C_INTERNAL, addr);
+        assert(status == OK);
+    }
+    send_int(BENCH, DONE, timer_micros() - t0);
+}
+
+#define NRADIO 20
+#define RADIO_LEN 32
+
+/* radio_test -- time sending of radio packets */
+static void radio_test(int arg)
+{
+    static byte packet[RADIO_LEN];
+    unsigned t0;
+
+    receive(GO, NULL);
+
+    t0 = timer_micros();
+    for (int i = 0; i < NRADIO; i++) {
+        packet[0] = i;
+        radio_send(packet, RADIO_LEN);
+    }
+    send_int(BENCH, DONE, timer_micros() - t0);
+}
+
+
+/* THE TESTS */
+
+static char *prio_name[NPRIO][2] = {
+    { "echo_handler", "sendrec_handler" },
+    { "echo_high", "sendrec_high" },
+    { "echo_low", "sendrec_low" }
+};
+
+/* test_ipc -- send/receive ping-pong and sendrec at each priority */
+static void test_ipc(void)
+{
+    message m;
+
+    for (int p = 0; p < NPRIO; p++) {
+        priority(p);
+
+        begin();
+        for (int i = 0; i < N; i++) {
+            send_msg(SERVER[p], ECHO);
+            receive(ECHO, NULL);
+        }
+        finish(prio_name[p][0], N);
+
+        begin();
+        for (int i = 0; i < N; i++) {
+            m.type = REQUEST;
+            sendrec(SERVER[p], &m);
+        }
+        finish(prio_name[p][1], N);
+    }
+
+    priority(P_LOW);
+}
+
+/* test_yield -- context switches between two processes */
+static void test_yield(void)
+{
+    send_msg(YIELDER, GO);
+    begin();
+    for (int i = 0; i < N; i++) yield();
+    receive(DONE, NULL);
+    finish("yield", 2*N);
+}
+
+/* test_interrupt -- latency from interrupt to handler process */
+static void test_interrupt(void)
+{
+    unsigned total = 0, worst = 0, t0, t;
+
+    for (int i = 0; i < N; i++) {
+#ifdef UBIT_V2
+        t0 = DWT_CYCCNT;
+#else
+        t0 = timer_micros();
+#endif
+        NVIC_ISPR[0] = BIT(SWI0_IRQ);
+        /* The handler process preempts us here, or a little later
+           under simulation */
+        while (irq_count == i) { }
+        t = irq_time - t0;
+        total += t;
+        if (t > worst) worst = t;
+    }
+
+#ifdef UBIT_V2
+    record("irq_latency", total/N, "cycles");
+    record("irq_latency_max", worst, "cycles");
+#else
+    record("irq_latency", total, "ns");
+    record("irq_latency_max", worst, "us");
+#endif
+}
+
+#ifdef UBIT_V2
+/* On V2, TIMER3 interrupts every URGENT_PERIOD ticks, and its handler
+measures the time since the compare event.  The handler does not call
+interrupt(), so it may be made urgent.  The test runs twice under a
+load of message passing at every priority: first with the timer at
+KERNEL_PRIO, where the kernel can hold it off, then above the kernel
+with irq_urgent(). */
+
+#define URGENT_PERIOD 997       /* 16MHz ticks; prime to avoid lock step */
+
+static volatile unsigned urg_count, urg_total, urg_worst;
+
+/* timer3_handler -- record latency of the compare interrupt */
+void timer3_handler(void)
+{
+    if (TIMER3_COMPARE[0]) {
+        TIMER3_CAPTURE[1] = 1;
+        unsigned t = TIMER3_CC[1] * 4; /* 64MHz cycles since compare */
+        TIMER3_COMPARE[0] = 0;
+        urg_count++;
+        urg_total += t;
+        if (t > urg_worst) urg_worst = t;
+    }
+}
+
+/* urgent_run -- measure timer latency under IPC load */
+static void urgent_run(char *mean, char *worst)
+{
+    message m;
+
+    urg_count = urg_total = urg_worst = 0;
+    TIMER3_CLEAR = 1;
+    TIMER3_START = 1;
+    enable_irq(TIMER3_IRQ);
+
+    for (int i = 0; i < 10*N; i++) {
+        int p = i % NPRIO;
+        send_msg(SERVER[p], ECHO);
+        receive(ECHO, NULL);
+        m.type = REQUEST;
+        sendrec(SERVER[p], &m);
+    }
+
+    disable_irq(TIMER3_IRQ);
+    TIMER3_STOP = 1;
+    record(mean, urg_total / (urg_count > 0 ? urg_count : 1), "cycles");
+    record(worst, urg_worst, "cycles");
+}
+
+/* test_urgent -- latency of a timer interrupt with and without BASEPRI */
+static void test_urgent(void)
+{
+    TIMER3_STOP = 1;
+    TIMER3_MODE = TIMER_MODE_Timer;
+    TIMER3_BITMODE = TIMER_BITMODE_16Bit;
+    TIMER3_PRESCALER = 0;       /* 16MHz */
+    TIMER3_CC[0] = URGENT_PERIOD;
+    TIMER3_SHORTS = BIT(TIMER_COMPARE0_CLEAR);
+    TIMER3_INTENSET = BIT(TIMER_INT_COMPARE0);
+
+    urgent_run("kernel_irq_latency", "kernel_irq_latency_max");
+    irq_urgent(TIMER3_IRQ, 0);
+    urgent_run("urgent_latency", "urgent_latency_max");
+    irq_priority(TIMER3_IRQ, KERNEL_PRIO);
+}
+#endif
+
+/* test_timeouts -- sendrec to a receive_t server, with timeouts armed */
+static void test_timeouts(void)
+{
+    message m;
+
+    begin();
+    for (int i = 0; i < N; i++) {
+        m.type = REQUEST;
+        sendrec(TIMED, &m);
+    }
+    finish("sendrec_t", N);
+
+    for (int i = 0; i < NSLEEP; i++)
+        send_msg(SLEEPER[i], GO);
+
+    begin();
+    for (int i = 0; i < N; i++) {
+        m.type = REQUEST;
+        sendrec(TIMED, &m);
+    }
+    finish("sendrec_t_armed" STR(NSLEEP), N);
+
+    for (int i = 0; i < NSLEEP; i++)
+        send_msg(SLEEPER[i], WAKE);
+}
+
+/* test_uwait -- lateness of microsecond timer wakeups */
+static void test_uwait(void)
+{
+    unsigned count, mean, worst, next = timer_ucount();
+
+    for (int i = 0; i < N; i++) {
+        next += 200;
+        timer_uwait(next);
+    }
+
+    timer_ustats(&count, &mean, &worst);
+    record("uwait_late", mean, "us");
+    record("uwait_late_max", worst, "us");
+}
+
+/* The tick test spins reading a clock, and counts any gap that is
+much longer than one trip around the loop as time taken by the clock
+tick (or occasionally some other interrupt).  On V2, the clock is the
+DWT cycle counter, and on V1 it is the microsecond counter. */
+
+#define TICK_SPIN 200000        /* Length of test (usec) */
+
+#ifdef UBIT_V2
+#define stamp() DWT_CYCCNT
+#define TICK_GAP 200            /* Threshold (cycles) */
+#define TICK_UNIT "cycles"
+#else
+#define stamp() timer_ucount()
+#define TICK_GAP 5              /* Threshold (usec) */
+#define TICK_UNIT "us"
+#endif
+
+/* test_tick -- time taken from a busy process by each tick */
+static void test_tick(void)
+{
+    unsigned stop = timer_micros() + TICK_SPIN;
+    unsigned prev = stamp(), now, total = 0, gaps = 0;
+
+    while ((int) (stop - timer_micros()) > 0) {
+        now = stamp();
+        if (now - prev > TICK_GAP) {
+            total += now - prev;
+            gaps++;
+        }
+        prev = stamp();
+    }
+
+    record("tick_cost", (gaps == 0 ? 0 : total / gaps), TICK_UNIT);
+    record("tick_gaps", gaps, "gaps");
+}
+
+#define NCOPY 1024
+
+/* test_memcpy -- aligned and unaligned copying */
+static void test_memcpy(void)
+{
+    static unsigned buf1[NCOPY/4+1], buf2[NCOPY/4+1];
+    char *p = (char *) buf1, *q = (char *) buf2;
+
+    begin();
+    for (int i = 0; i < 100; i++)
+        memcpy(p, q, NCOPY);
+    finish_rate("memcpy_aligned", 100 * NCOPY);
+
+    begin();
+    for (int i = 0; i < 100; i++)
+        memcpy(p+1, q+2, NCOPY);
+    finish_rate("memcpy_unaligned", 100 * NCOPY);
+
+    begin();
+    for (int i = 0; i < 100; i++)
+        memset(p, i, NCOPY);
+    finish_rate("memset", 100 * NCOPY);
+}
+
+/* test_sprintf -- formatting speed */
+static void test_sprintf(void)
+{
+    char buf[64];
+
+    begin();
+    for (int i = 0; i < N; i++)
+        sprintf(buf, "x=%d y=%u z=%x %s\n", -i, 123456*i, i, "bench");
+    finish("sprintf", N);
+}
+
+/* test_format -- formatted integers per second */
+static void test_format(void)
+{
+    char buf[64];
+    unsigned x = 1;
+
+    begin();
+    for (int i = 0; i < N; i++) {
+        sprintf(buf, "%d", (int) x);
+        x = 69069 * x + 1;
+    }
+    record("format_int", rate(N, elapsed()), "ints/s");
+
+    begin();
+    for (int i = 0; i < N; i++)
+        snprintf(buf, sizeof(buf), "%08x %-6d %lu", i, -i, 4000000000UL+i);
+    record("format_padded", rate(3*N, elapsed()), "ints/s");
+}
+
+#define NLOG 30                 /* Records that fit in the log buffer */
+
+/* test_log -- deferred logging against formatting the same text */
+static void test_log(void)
+{
+    char buf[64];
+    unsigned bytes = 0;
+
+    begin();
+    for (int i = 0; i < NLOG; i++)
+        bytes += sprintf(buf, "x=%d y=%u z=%x\n", -i, 123456*i, i) - 1;
+    finish("log_text", NLOG);
+    record("log_text_bytes", bytes / NLOG, "bytes");
+
+    /* The log process is not running, so the records stay put */
+    begin();
+    for (int i = 0; i < NLOG; i++)
+        log_printf("x=%d y=%u z=%x\n", -i, 123456*i, i);
+    finish("log_printf", NLOG);
+    record("log_printf_bytes", log_pending() / NLOG, "bytes");
+}
+
+/* test_device -- run a device test in a helper with a timeout */
+static void test_device(char *name, int pid, unsigned count, char *unit,
+                        int wait)
+{
+    message m;
+
+    send_msg(pid, GO);
+    receive_t(DONE, &m, wait);
+    if (m.type == TIMEOUT || m.int1 == 0)
+        record(name, 0, NULL);
+    else
+        record(name, rate(count, m.int1), unit);
+}
+
+#define NSERIAL 2048
+
+/* test_serial -- output throughput, well beyond the 256 byte buffer */
+static void test_serial(void)
+{
+    static char line[64];
+    unsigned bytes = 0;
+
+    for (int i = 0; i < 63; i++)
+        line[i] = 'a' + i%26;
+    line[63] = '\n';
+
+    begin();
+    for (int i = 0; i < NSERIAL; i++)
+        serial_putc(line[i%64]);
+    finish_rate("serial_putc", NSERIAL + NSERIAL/64); /* \n is \r\n */
+
+    begin();
+    for (int i = 0; i < 32; i++)
+        bytes += printf("printf %d %x %s\n", i, 0xbeef, "throughput") + 1;
+    finish_rate("printf", bytes); /* Each \n becomes \r\n */
+}
+
+#define NLINES 32
+
+/* Rates for test_baud */
+static const int baud_rate[] = { 9600, 115200, 460800, 1000000 };
+static char *baud_name[] = {
+    "serial_9600", "serial_115200", "serial_460800", "serial_1M"
+};
+
+/* test_baud -- sustained output throughput at each baud rate.  Output
+   at rates other than the one being captured appears as noise. */
+static void test_baud(void)
+{
+    static char line[65];
+
+    for (int i = 0; i < 63; i++)
+        line[i] = 'a' + i%26;
+    line[63] = '\n';
+
+    for (int k = 0; k < 4; k++) {
+        serial_config(baud_rate[k], 0);
+        begin();
+        for (int i = 0; i < NLINES; i++)
+            printf("%s", line);
+        serial_config(baud_rate[k], 0); /* Wait until all is sent */
+        finish_rate(baud_name[k], 65*NLINES); /* Each \n becomes \r\n */
+    }
+
+    serial_config(SERIAL_BAUD, 0);
+}
+
+/* bench -- run the tests */
+static void bench(int arg)
+{
+    timer_delay(100);           /* Let everything start up */
+    printf("\nmicro:bian benchmarks\n");
+#ifdef UBIT_V1
+    printf("board v1\n");
+#endif
+#ifdef UBIT_V2
+    printf("board v2\n");
+    SET_BIT(DEBUG_DEMCR, DEBUG_DEMCR_TRCENA);
+    DWT_CYCCNT = 0;
+    SET_BIT(DWT_CTRL, DWT_CTRL_CYCCNTENA);
+#endif
+#ifdef RAMCODE
+    printf("ramcode 1\n");
+#else
+    printf("ramcode 0\n");
+#endif
+    timer_delay(100);
+
+    test_yield();
+    test_ipc();
+    test_interrupt();
+#ifdef UBIT_V2
+    test_urgent();
+#endif
+    test_timeouts();
+    test_uwait();
+    test_tick();
+    test_memcpy();
+    test_sprintf();
+    test_format();
+    test_log();
+    test_device("i2c_probe", I2CTEST, NI2C, "probes/s", 2000);
+    test_device("radio_send", RADIOTEST, NRADIO*RADIO_LEN, "bytes/s",
+                2000);
+    show_results();
+
+    timer_delay(1000);
+    test_serial();
+    test_baud();
+    timer_delay(1000);
+    show_results();
+    printf("done\n");
+}
+
+void init(void)
+{
+    serial_init();
+    timer_init();
+    i2c_init(I2C_INTERNAL);
+    radio_init();
+
+    BENCH = start("Bench", bench, 0, STACK);
+    YIELDER = start("Yielder", yielder, 0, 256);
+    for (int p = 0; p < NPRIO; p++)
+        SERVER[p] = start("Server", server, p, 256);
+    TIMED = start("Timed", timed_server, 0, 256);
+    for (int i = 0; i < NSLEEP; i++)
+        SLEEPER[i] = start("Sleeper", sleeper, 0, 256);
+    IRQ = start("Irq", irq_task, 0, 256);
+    I2CTEST = start("I2Ctest", i2c_test, 0, 256);
+    RADIOTEST = start("Radiotest", radio_test, 0, 256);
+}
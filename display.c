@@ -77,7 +77,7 @@ void display_task(int dummy) {
 
 #ifdef UBIT_V1
     GPIO_DIRSET = LED_MASK;
-    timer_pulse(5);             /* 5ms x 3 = 15ms updates */
+    timer_periodic(5);          /* 5ms x 3 = 15ms updates */
 #endif
     
 #ifdef UBIT_V2
@@ -91,7 +91,7 @@ void display_task(int dummy) {
     gpio_drive(ROW4, GPIO_DRIVE_S0H1);
     gpio_drive(ROW5, GPIO_DRIVE_S0H1);
 
-    timer_pulse(3);             /* 3ms * 5 = 15ms updates */
+    timer_periodic(3);          /* 3ms * 5 = 15ms updates */
 #endif
 
     image_clear(display_image);
@@ -115,7 +115,7 @@ void display_task(int dummy) {
         if (n == 10) n = 0;
 #endif
 
-        receive(PING, NULL);
+        wait_next_period();
     }
 }
 
@@ -0,0 +1,66 @@
+/* host/hardware.h */
+/* Copyright (c) 2026 J. M. Spivey */
+
+/* The host port runs micro:bian as an ordinary Linux program, for
+testing and profiling.  It pretends to be a V1 board: the device
+registers are ordinary memory mapped at the same addresses, and a
+thread in host/startup.c plays the part of the UART and the timers.
+Interrupts are simulated with a signal, so disabling interrupts means
+blocking the signal. */
+
+#include "../ubit-v1/hardware.h"
+
+#define HOST 1
+
+/* The CPU: see host/startup.c */
+void cpu_pause(void);
+void cpu_disable(void);
+void cpu_enable(void);
+unsigned cpu_primask(void);
+void cpu_set_primask(unsigned x);
+int cpu_active_irq(void);
+extern volatile int cpu_pendsv;
+extern unsigned long cpu_irq_pc; /* PC when last interrupted */
+
+#undef pause
+#undef intr_disable
+#undef intr_enable
+#undef get_primask
+#undef set_primask
+#define pause()         cpu_pause()
+#define intr_disable()  cpu_disable()
+#define intr_enable()   cpu_enable()
+#define get_primask()   cpu_primask()
+#define set_primask(x)  cpu_set_primask(x)
+
+#undef reschedule
+#define reschedule()    cpu_pendsv = 1
+
+#undef active_irq
+#define active_irq()    cpu_active_irq()
+
+/* Capture tasks on a real timer take effect at once, but the timer
+thread would see them too late.  So the timer macros call functions
+that take a snapshot of the count whenever a capture task is written,
+and copy it into the CC register before it is read. */
+unsigned volatile *timer_capture(int n);
+unsigned volatile *timer_cc(int n);
+
+#undef TIMER0_CAPTURE
+#undef TIMER1_CAPTURE
+#undef TIMER2_CAPTURE
+#undef TIMER0_CC
+#undef TIMER1_CC
+#undef TIMER2_CC
+#define TIMER0_CAPTURE  timer_capture(0)
+#define TIMER1_CAPTURE  timer_capture(1)
+#define TIMER2_CAPTURE  timer_capture(2)
+#define TIMER0_CC       timer_cc(0)
+#define TIMER1_CC       timer_cc(1)
+#define TIMER2_CC       timer_cc(2)
+
+/* Likewise, the RTC counter is read directly, so it is a function. */
+unsigned rtc_counter(void);
+
+#undef RTC1_COUNTER
+#define RTC1_COUNTER    rtc_counter()
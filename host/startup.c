@@ -0,0 +1,677 @@
+/* host/startup.c */
+/* Copyright (c) 2026 J. M. Spivey */
+
+/* Startup code for the host port, with a crude model of the parts of
+the hardware that micro:bian needs.  The CPU is the main thread of the
+program, and its interrupt request line is the signal SIG_IRQ, so
+disabling interrupts means blocking the signal.  A second thread plays
+the part of the peripherals: it polls the device registers, which are
+ordinary memory, and raises interrupts by sending the signal.
+
+Only the UART and the three timers are simulated.  The UART is
+connected to the standard input and output, and the timers run at the
+same rate as on the chip, in real time.  Other devices just ignore
+whatever is written to their registers, so programs that use them
+will wait for ever. */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hardware.h"
+
+/* init -- main program, creates application processes */
+void init(void);
+
+void default_start(void)
+{
+    init();                    /* Call the main program. */
+    while (1) pause();         /* Halt if init() returns */
+}
+
+void __start(void) __attribute((weak, alias("default_start")));
+
+
+/* MEMORY */
+
+/* Device registers live in these parts of the address space */
+static const struct {
+    unsigned long base, size;
+} devmem[] = {
+    { 0x10000000, 0x2000 },     /* FICR and UICR */
+    { 0x40000000, 0x30000 },    /* Peripherals */
+    { 0x50000000, 0x1000 },     /* GPIO */
+    { 0xe0000000, 0x100000 }    /* Private peripheral bus */
+};
+
+#define NDEVMEM (sizeof(devmem) / sizeof(devmem[0]))
+
+/* The kernel allocates process stacks and descriptors from the space
+between __end and __stack_limit, which on the chip are set by the
+linker script.  Stacks are much bigger on the host, because signal
+handlers run on them. */
+asm ("    .pushsection .bss\n"
+     "    .globl __end, __stack_limit\n"
+     "    .balign 16\n"
+     "__end:\n"
+     "    .space 0x400000\n"
+     "__stack_limit:\n"
+     "    .popsection");
+
+
+/* CPU */
+
+#define SIG_IRQ SIGUSR1         /* Signal for interrupts */
+
+static pthread_t cpu_thread;    /* Thread that runs the CPU */
+static sigset_t irq_mask;       /* Signal set containing SIG_IRQ */
+static volatile int irq_active = -16; /* Active interrupt or -16 */
+
+volatile int cpu_pendsv = 0;    /* Whether PendSV is requested */
+
+/* cpu_disable -- disable interrupts */
+void cpu_disable(void)
+{
+    pthread_sigmask(SIG_BLOCK, &irq_mask, NULL);
+}
+
+/* cpu_enable -- enable interrupts */
+void cpu_enable(void)
+{
+    pthread_sigmask(SIG_UNBLOCK, &irq_mask, NULL);
+}
+
+/* cpu_primask -- 1 if interrupts are disabled, like PRIMASK */
+unsigned cpu_primask(void)
+{
+    sigset_t s;
+    pthread_sigmask(SIG_BLOCK, NULL, &s);
+    return sigismember(&s, SIG_IRQ);
+}
+
+/* cpu_set_primask -- restore state saved by cpu_primask */
+void cpu_set_primask(unsigned x)
+{
+    if (x)
+        cpu_disable();
+    else
+        cpu_enable();
+}
+
+/* cpu_pause -- wait for an interrupt */
+void cpu_pause(void)
+{
+    sigset_t s;
+    pthread_sigmask(SIG_BLOCK, NULL, &s);
+    sigdelset(&s, SIG_IRQ);
+    sigsuspend(&s);
+}
+
+/* cpu_active_irq -- interrupt being handled, or -16 in thread mode */
+int cpu_active_irq(void)
+{
+    return irq_active;
+}
+
+
+/* NVIC */
+
+static volatile unsigned nvic_enabled = 0;
+static volatile unsigned nvic_pending = 0;
+
+/* nvic_raise -- make an IRQ pending, and interrupt the CPU if enabled */
+static void nvic_raise(int irq)
+{
+    __atomic_or_fetch(&nvic_pending, BIT(irq), __ATOMIC_SEQ_CST);
+    if (nvic_enabled & BIT(irq))
+        pthread_kill(cpu_thread, SIG_IRQ);
+}
+
+/* nvic_take -- find and clear highest priority active interrupt */
+static int nvic_take(void)
+{
+    unsigned active = nvic_pending & nvic_enabled;
+    if (active == 0) return -1;
+
+    int irq = __builtin_ctz(active);
+    __atomic_and_fetch(&nvic_pending, ~BIT(irq), __ATOMIC_SEQ_CST);
+    return irq;
+}
+
+/* irq_priority -- set priority for an IRQ to a value [0..255] */
+void irq_priority(int irq, unsigned prio)
+{
+    /* All interrupts have the same priority on the host */
+}
+
+/* enable_irq -- enable interrupts from an IRQ */
+void enable_irq(int irq)
+{
+    __atomic_or_fetch(&nvic_enabled, BIT(irq), __ATOMIC_SEQ_CST);
+    if (nvic_pending & BIT(irq))
+        pthread_kill(cpu_thread, SIG_IRQ);
+}
+
+/* disable_irq -- disable interrupts from a specific IRQ */
+void disable_irq(int irq)
+{
+    __atomic_and_fetch(&nvic_enabled, ~BIT(irq), __ATOMIC_SEQ_CST);
+}
+
+/* clear_pending -- clear pending interrupt from an IRQ */
+void clear_pending(int irq)
+{
+    __atomic_and_fetch(&nvic_pending, ~BIT(irq), __ATOMIC_SEQ_CST);
+}
+
+
+/* DEVICE TABLES */
+
+volatile struct _timer * const TIMER[] = {
+    TIMER0, TIMER1, TIMER2
+};
+
+volatile struct _i2c * const I2C[] = {
+    I2C0, I2C1
+};
+
+volatile struct _spi * const SPI[] = {
+    SPI0, SPI1
+};
+
+
+/* TIMERS */
+
+/* The count of each timer is calculated from the time on the host
+clock.  With a COMPAREn_CLEAR short, the count goes up to CC[n] and
+starts again at zero, and otherwise it wraps around according to the
+bit mode.  The device thread sets the COMPARE events when the count
+passes each CC register. */
+
+static struct {
+    int running;                /* Whether the timer is started */
+    unsigned long long start;   /* Host time when started (nsec) */
+    unsigned long long base;    /* Count when started */
+    unsigned long long last;    /* Count at last poll */
+    unsigned inten;             /* Enabled interrupts */
+    unsigned snapshot;          /* Count at last capture task */
+} tmr[3];
+
+/* clock_ns -- host time in nanoseconds */
+static unsigned long long clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* timer_total -- ticks of timer n since it was last cleared */
+static unsigned long long timer_total(int n, unsigned long long now)
+{
+    if (! tmr[n].running) return tmr[n].base;
+    return tmr[n].base + (((now - tmr[n].start) * 16 / 1000)
+                          >> TIMER[n]->PRESCALER);
+}
+
+/* timer_modulus -- count at which timer n starts again from zero */
+static unsigned long long timer_modulus(int n)
+{
+    volatile struct _timer *t = TIMER[n];
+
+    for (int i = 0; i < 4; i++) {
+        if (GET_BIT(t->SHORTS, TIMER_COMPARE0_CLEAR+i) && t->CC[i] != 0)
+            return t->CC[i];
+    }
+
+    switch (t->BITMODE) {
+    case TIMER_BITMODE_8Bit:
+        return 1ULL << 8;
+    case TIMER_BITMODE_24Bit:
+        return 1ULL << 24;
+    case TIMER_BITMODE_32Bit:
+        return 1ULL << 32;
+    default:
+        return 1ULL << 16;
+    }
+}
+
+/* timer_commit -- copy the snapshot into CC for pending capture tasks */
+static void timer_commit(int n)
+{
+    volatile struct _timer *t = TIMER[n];
+
+    for (int i = 0; i < 4; i++) {
+        if (t->CAPTURE[i]) {
+            t->CC[i] = tmr[n].snapshot;
+            t->CAPTURE[i] = 0;
+        }
+    }
+}
+
+/* timer_capture -- address of CAPTURE tasks for timer n */
+unsigned volatile *timer_capture(int n)
+{
+    timer_commit(n);
+    tmr[n].snapshot = timer_total(n, clock_ns()) % timer_modulus(n);
+    return TIMER[n]->CAPTURE;
+}
+
+/* timer_cc -- address of CC registers for timer n */
+unsigned volatile *timer_cc(int n)
+{
+    timer_commit(n);
+    return TIMER[n]->CC;
+}
+
+/* hits -- count of values in [0..x] that are congruent to r mod m */
+static unsigned long long hits(unsigned long long x,
+                               unsigned long long r, unsigned long long m)
+{
+    return (x < r ? 0 : (x - r) / m + 1);
+}
+
+/* task -- test and clear a task register */
+#define task(reg) __atomic_exchange_n(&(reg), 0, __ATOMIC_SEQ_CST)
+
+/* timer_poll -- update timer n */
+static void timer_poll(int n, unsigned long long now)
+{
+    volatile struct _timer *t = TIMER[n];
+    unsigned x;
+
+    if (task(t->STOP) && tmr[n].running) {
+        tmr[n].base = timer_total(n, now);
+        tmr[n].running = 0;
+    }
+    if (task(t->CLEAR)) {
+        tmr[n].base = tmr[n].last = 0;
+        tmr[n].start = now;
+    }
+    if (task(t->START) && ! tmr[n].running) {
+        tmr[n].start = now;
+        tmr[n].running = 1;
+    }
+
+    if ((x = task(t->INTENSET)) != 0) tmr[n].inten |= x;
+    if ((x = task(t->INTENCLR)) != 0) tmr[n].inten &= ~x;
+
+    unsigned long long count = timer_total(n, now);
+    unsigned long long m = timer_modulus(n);
+    for (int i = 0; i < 4; i++) {
+        unsigned long long r = t->CC[i] % m;
+        if (hits(count, r, m) > hits(tmr[n].last, r, m))
+            t->COMPARE[i] = 1;
+
+        if (t->COMPARE[i] && GET_BIT(tmr[n].inten, TIMER_INT_COMPARE0+i))
+            nvic_raise(TIMER0_IRQ+n);
+    }
+    tmr[n].last = count;
+}
+
+
+/* RTC */
+
+/* RTC1 is modelled in the same way as the timers, counting at
+32768Hz divided by PRESCALER+1 and wrapping around in 24 bits.  The
+low-frequency clock starts at once. */
+
+static struct {
+    int running;                /* Whether the RTC is started */
+    unsigned long long start;   /* Host time when started (nsec) */
+    unsigned long long base;    /* Count when started */
+    unsigned long long last;    /* Count at last poll */
+    unsigned inten;             /* Enabled interrupts */
+} rtc;
+
+/* rtc_total -- ticks of the RTC since it was last cleared */
+static unsigned long long rtc_total(unsigned long long now)
+{
+    if (! rtc.running) return rtc.base;
+    return rtc.base + (now - rtc.start) * 32768 / 1000000000
+        / (RTC1_PRESCALER + 1);
+}
+
+/* rtc_counter -- value of the RTC1_COUNTER register */
+unsigned rtc_counter(void)
+{
+    return rtc_total(clock_ns()) & 0xffffff;
+}
+
+/* rtc_poll -- update RTC1 */
+static void rtc_poll(unsigned long long now)
+{
+    unsigned x;
+
+    if (task(CLOCK_LFCLKSTART)) CLOCK_LFCLKSTARTED = 1;
+
+    if (task(RTC1_STOP) && rtc.running) {
+        rtc.base = rtc_total(now);
+        rtc.running = 0;
+    }
+    if (task(RTC1_CLEAR)) {
+        rtc.base = rtc.last = 0;
+        rtc.start = now;
+    }
+    if (task(RTC1_START) && ! rtc.running) {
+        rtc.start = now;
+        rtc.running = 1;
+    }
+
+    if ((x = task(RTC1_INTENSET)) != 0) rtc.inten |= x;
+    if ((x = task(RTC1_INTENCLR)) != 0) rtc.inten &= ~x;
+
+    unsigned long long count = rtc_total(now);
+    for (int i = 0; i < 4; i++) {
+        unsigned long long r = RTC1_CC[i] & 0xffffff;
+        if (hits(count, r, 1 << 24) > hits(rtc.last, r, 1 << 24))
+            RTC1_COMPARE[i] = 1;
+
+        if (RTC1_COMPARE[i] && GET_BIT(rtc.inten, RTC_INT_COMPARE0+i))
+            nvic_raise(RTC1_IRQ);
+    }
+    rtc.last = count;
+}
+
+
+/* UART */
+
+/* The transmitter is idle when UART_TXD contains NONE, and the device
+thread replaces each character written there with NONE after sending
+it to the standard output.  Carriage returns are dropped if the
+output is a terminal, but kept if it is captured in a file, because it
+may contain binary data from log_printf (see log.c).  Each
+character keeps the transmitter busy for ten bit times at the rate set
+in UART_BAUDRATE, so output runs no faster than on the board; but the
+device thread polls only every POLL nsec, so rates above about 200000
+baud are no faster than that. */
+
+#define NONE 0xffffffff
+
+#define POLL 50000              /* Polling interval (nsec) */
+
+static unsigned uart_inten = 0; /* Enabled interrupts */
+static unsigned long long uart_busy = 0; /* Time transmitter is free */
+static int uart_rx = 0;         /* Whether the receiver is started */
+static int uart_eof = 0;        /* Whether input is exhausted */
+static int uart_tty = -1;       /* Whether output is a terminal */
+
+/* char_ns -- time to send a character: BAUDRATE is baud * 2^32 / 16MHz */
+static unsigned long long char_ns(void)
+{
+    unsigned rate = UART_BAUDRATE;
+    if (rate == 0) rate = UART_BAUDRATE_9600;
+    return 625ULL * (1ULL << 32) / rate;
+}
+
+/* uart_poll -- update the UART */
+static void uart_poll(int ready, unsigned long long now)
+{
+    unsigned x;
+    char ch;
+
+    if (now >= uart_busy
+        && (x = __atomic_exchange_n(&UART_TXD, NONE, __ATOMIC_SEQ_CST))
+        != NONE) {
+        ch = x;
+        if (uart_tty < 0) uart_tty = isatty(1);
+        if (ch != '\r' || ! uart_tty) write(1, &ch, 1);
+        UART_TXDRDY = 1;
+
+        /* Characters written while the last was sent go back to back */
+        if (now > uart_busy + POLL) uart_busy = now;
+        uart_busy += char_ns();
+    }
+
+    if (task(UART_STARTRX)) uart_rx = 1;
+
+    if (ready && uart_rx && ! UART_RXDRDY) {
+        if (read(0, &ch, 1) == 1) {
+            UART_RXD = ch;
+            UART_RXDRDY = 1;
+        } else {
+            uart_eof = 1;
+        }
+    }
+
+    if ((x = task(UART_INTENSET)) != 0) uart_inten |= x;
+    if ((x = task(UART_INTENCLR)) != 0) uart_inten &= ~x;
+
+    if ((UART_RXDRDY && GET_BIT(uart_inten, UART_INT_RXDRDY))
+        || (UART_TXDRDY && GET_BIT(uart_inten, UART_INT_TXDRDY)))
+        nvic_raise(UART_IRQ);
+}
+
+
+/* DEVICE THREAD */
+
+/* devices -- body of the device thread */
+static void *devices(void *arg)
+{
+    struct pollfd pfd = { 0, POLLIN, 0 };
+    struct timespec interval = { 0, POLL };
+    int ready = 0, n;
+    unsigned x;
+
+    while (1) {
+        unsigned long long now = clock_ns();
+
+        uart_poll(ready, now);
+        for (int i = 0; i < 3; i++) timer_poll(i, now);
+        rtc_poll(now);
+
+        /* Interrupts can be triggered in software too */
+        if ((x = task(NVIC_ISPR[0])) != 0) {
+            for (int irq = 0; irq < N_INTERRUPTS; irq++)
+                if (GET_BIT(x, irq)) nvic_raise(irq);
+        }
+
+        /* Look for input only when the UART can accept it */
+        n = (uart_rx && ! uart_eof && ! UART_RXDRDY);
+        ready = (ppoll(&pfd, n, &interval, NULL) > 0);
+    }
+
+    return NULL;
+}
+
+
+/* TERMINAL */
+
+/* If the standard input is a terminal, it is put into a mode where
+each keystroke is passed on at once without echoing, because the
+serial driver does its own line editing. */
+
+static struct termios term_saved;
+static int term_raw = 0;
+
+/* term_setup -- set terminal mode */
+static void term_setup(void)
+{
+    struct termios t;
+
+    if (! isatty(0) || tcgetattr(0, &term_saved) < 0) return;
+    t = term_saved;
+    t.c_lflag &= ~(ICANON | ECHO);
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSANOW, &t);
+    term_raw = 1;
+}
+
+/* term_restore -- put the terminal back as it was */
+static void term_restore(void)
+{
+    if (term_raw) tcsetattr(0, TCSANOW, &term_saved);
+}
+
+/* quit -- handler for SIGINT and SIGTERM */
+static void quit(int sig)
+{
+    term_restore();
+    _exit(128+sig);
+}
+
+
+/* INTERRUPT VECTORS */
+
+/* delay_loop -- timed delay */
+void delay_loop(unsigned usecs)
+{
+    unsigned long long t = clock_ns() + 1000ULL * usecs;
+    while (clock_ns() < t) { }
+}
+
+/* spin -- the program has failed: exit */
+void spin(void)
+{
+    intr_disable();
+    term_restore();
+    _exit(1);
+}
+
+void default_handler(void) __attribute((weak, alias("spin")));
+
+/* Handlers that are not defined elsewhere are weak references that
+are null, and we call default_handler instead. */
+
+void pendsv_handler(void);
+
+#define weak __attribute((weak))
+
+weak void uart_handler(void);
+weak void timer0_handler(void);
+weak void timer1_handler(void);
+weak void timer2_handler(void);
+weak void power_clock_handler(void);
+weak void radio_handler(void);
+weak void i2c_spi0_handler(void);
+weak void i2c_spi1_handler(void);
+weak void gpiote_handler(void);
+weak void adc_handler(void);
+weak void rtc0_handler(void);
+weak void temp_handler(void);
+weak void rng_handler(void);
+weak void ecb_handler(void);
+weak void ccm_aar_handler(void);
+weak void wdt_handler(void);
+weak void rtc1_handler(void);
+weak void qdec_handler(void);
+weak void lpcomp_handler(void);
+weak void swi0_handler(void);
+weak void swi1_handler(void);
+weak void swi2_handler(void);
+weak void swi3_handler(void);
+weak void swi4_handler(void);
+weak void swi5_handler(void);
+
+static void (* const vector[N_INTERRUPTS])(void) = {
+    power_clock_handler,        /*  0 */
+    radio_handler,
+    uart_handler,
+    i2c_spi0_handler,
+    i2c_spi1_handler,           /*  4 */
+    0,
+    gpiote_handler,
+    adc_handler,
+    timer0_handler,             /*  8 */
+    timer1_handler,
+    timer2_handler,
+    rtc0_handler,
+    temp_handler,               /* 12 */
+    rng_handler,
+    ecb_handler,
+    ccm_aar_handler,
+    wdt_handler,                /* 16 */
+    rtc1_handler,
+    qdec_handler,
+    lpcomp_handler,
+    swi0_handler,               /* 20 */
+    swi1_handler,
+    swi2_handler,
+    swi3_handler,
+    swi4_handler,               /* 24 */
+    swi5_handler,
+    0,
+    0,
+    0,                          /* 28 */
+    0,
+    0,
+    0
+};
+
+/* cpu_irq_pc -- PC where the CPU thread was interrupted */
+unsigned long cpu_irq_pc;
+
+/* irq_entry -- signal handler that takes interrupts, then PendSV */
+static void irq_entry(int sig, siginfo_t *info, void *uc)
+{
+    int irq, prev = irq_active;
+
+#ifdef REG_RIP
+    cpu_irq_pc = ((ucontext_t *) uc)->uc_mcontext.gregs[REG_RIP];
+#endif
+
+    while ((irq = nvic_take()) >= 0) {
+        irq_active = irq;
+        if (vector[irq] != 0)
+            vector[irq]();
+        else
+            default_handler();
+    }
+    irq_active = prev;
+
+    if (cpu_pendsv) {
+        cpu_pendsv = 0;
+        pendsv_handler();
+    }
+}
+
+
+/* main -- the system starts here */
+int main(void)
+{
+    struct sigaction sa;
+    pthread_t dev_thread;
+
+    for (int i = 0; i < NDEVMEM; i++) {
+        if (mmap((void *) devmem[i].base, devmem[i].size,
+                 PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0)
+            != (void *) devmem[i].base) {
+            static const char msg[] = "Can't map device registers\n";
+            write(2, msg, sizeof(msg)-1);
+            _exit(2);
+        }
+    }
+
+    UART_TXD = NONE;
+
+    sigemptyset(&irq_mask);
+    sigaddset(&irq_mask, SIG_IRQ);
+
+    sa.sa_sigaction = irq_entry;
+    sa.sa_mask = irq_mask;
+    sa.sa_flags = SA_RESTART|SA_SIGINFO;
+    sigaction(SIG_IRQ, &sa, NULL);
+
+    sa.sa_handler = quit;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    term_setup();
+
+    /* The device thread never takes interrupts */
+    cpu_thread = pthread_self();
+    intr_disable();
+    pthread_create(&dev_thread, NULL, devices, NULL);
+    intr_enable();
+
+    __start();
+    return 0;
+}
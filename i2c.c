@@ -22,7 +22,7 @@ static const struct {
     int irq;
 } i2c_pins[N_I2C] = {
 #ifdef UBIT_V1
-    { I2C_SCL, I2C_SDA, I2C_IRQ }
+    { I2C_SCL, I2C_SDA, I2C0_IRQ }
 #endif
 #ifdef UBIT_V2
     { I2C0_SCL, I2C0_SDA, I2C0_IRQ },
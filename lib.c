@@ -4,33 +4,57 @@
 #include "lib.h"
 #include "hardware.h"
 
-#define NMAX 16                 // Max digits in a printed number
+#define NMAX 24                 // Max digits in a printed number
+
+/* Numbers are converted without division, because the Cortex-M0 on V1
+has no divide instruction, and each call of the library routine for
+division costs many cycles.  Hex digits need only shifts; decimal
+digits use div10, which multiplies by (nearly) 0.1 using shifts and
+adds, then corrects the result (see Hacker's Delight, section 10-17).
+The same code deals with 64-bit longs when the host port is used.  On
+V2, the compiler turns x / 10 into a long multiply by a reciprocal,
+and that is quicker still. */
+
+/* div10 -- divide by 10 without using division */
+static inline unsigned long div10(unsigned long x) {
+#ifdef UBIT_V2
+    return x / 10;
+#else
+    unsigned long q, r;
+
+    q = (x >> 1) + (x >> 2);
+    q += (q >> 4);
+    q += (q >> 8);
+    q += (q >> 16);
+    q += (q >> 16) >> 16;       // Needed only if long has 64 bits
+    q >>= 3;
+    r = x - 10*q;               // Now 0 <= r < 20
+    return (r > 9 ? q+1 : q);
+#endif
+}
 
 /* utoa -- convert unsigned to decimal or hex */
-static char *utoa(unsigned x, unsigned base, char *nbuf) {
+static char *utoa(unsigned long x, unsigned base, char *nbuf) {
     char *p = &nbuf[NMAX];
     const char *hex = "0123456789abcdef";
 
     *--p = '\0';
-    do {
-        *--p = hex[x % base];
-        x = x / base;
-    } while (x != 0);
+    if (base == 16) {
+        do {
+            *--p = hex[x & 0xf];
+            x >>= 4;
+        } while (x != 0);
+    } else {
+        do {
+            unsigned long q = div10(x);
+            *--p = '0' + (x - 10*q);
+            x = q;
+        } while (x != 0);
+    }
      
     return p;
 }
 
-/* itoa -- convert signed integer to decimal */
-static char *itoa(int v, char *nbuf) {
-    if (v >= 0)
-        return utoa(v, 10, nbuf);
-    else {
-        char *p = utoa(-v, 10, nbuf);
-        *--p = '-';
-        return p;
-    }
-}
-
 /* atoi -- convert decimal string to integer */
 int atoi(const char *p) {
     unsigned x = 0;
@@ -72,53 +96,114 @@ unsigned xtou(char *p) {
 
 /* The functions defined here provide a version of printf that calls a
 client-supplied function print_buf to output characters, a thread-safe
-version of sprintf, and a skeleton do_print that calls a supplied
-function on each output character.  The print_buf interface is
-potentially the most efficient, because printf buffers characters
-internally and passes them to print_buf 16 at a time, reducing context
-switches if print_buf sends messages to a device driver process.
-
-The three public functions share a common skeleton _do_print that
+version of sprintf and a bounded snprintf, and a skeleton do_print
+that calls a supplied function on each output character.  The
+print_buf interface is potentially the most efficient, because printf
+buffers characters internally and passes them to print_buf 16 at a
+time, reducing context switches if print_buf sends messages to a
+device driver process.
+
+The public functions share a common skeleton _do_print that
 takes as parameters a "putc-function" and a pointer q that is passed
 to the function with each character.  Different putc-functions and
 different interpretations of the pointer q are needed for different
 applications. */
 
+/* Each conversion may have flags '-' (to pad on the right) and '0'
+(to pad numbers with zeros), a field width, and a length modifier 'l'
+for a long argument; the conversions are %c, %d, %s, %u, %x (with a
+prefix 0x unless the value is zero) and %p.  The width includes any
+sign or prefix, and zeros for padding come after it. */
+
 /* do_string -- output or buffer each character of a string */
-static void do_string(void (*putc)(void *, char), void *q, char *str) {
-    for (char *p = str; *p != '\0'; p++)
+static void do_string(void (*putc)(void *, char), void *q, const char *str) {
+    for (const char *p = str; *p != '\0'; p++)
         putc(q, *p);
 }
 
+/* do_pad -- output n copies of a character */
+static void do_pad(void (*putc)(void *, char), void *q, char ch, int n) {
+    for (int i = 0; i < n; i++)
+        putc(q, ch);
+}
+
+/* length -- length of a string */
+static int length(const char *str) {
+    const char *p = str;
+    while (*p != '\0') p++;
+    return p - str;
+}
+
+/* do_field -- output a prefix and string padded to a field width */
+static void do_field(void (*putc)(void *, char), void *q,
+                     const char *prefix, const char *str,
+                     int width, int left, int zero) {
+    int pad = width - length(prefix) - length(str);
+
+    if (! left && ! zero) do_pad(putc, q, ' ', pad);
+    do_string(putc, q, prefix);
+    if (! left && zero) do_pad(putc, q, '0', pad);
+    do_string(putc, q, str);
+    if (left) do_pad(putc, q, ' ', pad);
+}
+
 /* _do_print -- the guts of printf */
 void _do_print(void (*putc)(void *, char), void *q,
                const char *fmt, va_list va) {
-    int x;
+    long x;
+    unsigned long u;
     char nbuf[NMAX];
 
     for (const char *p = fmt; *p != 0; p++) {
         if (*p == '%' && *(p+1) != '\0') {
-            switch (*++p) {
+            int left = 0, zero = 0, width = 0, lng = 0;
+
+            for (;;) {
+                p++;
+                if (*p == '-')
+                    left = 1;
+                else if (*p == '0')
+                    zero = 1;
+                else
+                    break;
+            }
+            while (*p >= '0' && *p <= '9')
+                width = 10 * width + (*p++ - '0');
+            if (*p == 'l') {
+                lng = 1; p++;
+            }
+            if (*p == '\0') break;
+
+            switch (*p) {
             case 'c':
+                if (! left) do_pad(putc, q, ' ', width-1);
                 putc(q, va_arg(va, int));
+                if (left) do_pad(putc, q, ' ', width-1);
                 break;
             case 'd':
-                do_string(putc, q, itoa(va_arg(va, int), nbuf));
+                x = (lng ? va_arg(va, long) : va_arg(va, int));
+                if (x >= 0)
+                    do_field(putc, q, "", utoa(x, 10, nbuf),
+                             width, left, zero);
+                else
+                    do_field(putc, q, "-", utoa(- (unsigned long) x, 10, nbuf),
+                             width, left, zero);
                 break;
             case 's':
-                do_string(putc, q, va_arg(va, char *));
+                do_field(putc, q, "", va_arg(va, char *), width, left, 0);
                 break;
             case 'u':
-                do_string(putc, q, utoa(va_arg(va, unsigned), 10, nbuf));
+                u = (lng ? va_arg(va, unsigned long) : va_arg(va, unsigned));
+                do_field(putc, q, "", utoa(u, 10, nbuf), width, left, zero);
                 break;
             case 'x':
-                x = va_arg(va, unsigned);
-                if (x == 0)
-                    putc(q, '0');
-                else {
-                    putc(q, '0'); putc(q, 'x');
-                    do_string(putc, q, utoa(x, 16, nbuf));
-                }
+                u = (lng ? va_arg(va, unsigned long) : va_arg(va, unsigned));
+                do_field(putc, q, (u == 0 ? "" : "0x"), utoa(u, 16, nbuf),
+                         width, left, zero);
+                break;
+            case 'p':
+                u = (unsigned long) va_arg(va, void *);
+                do_field(putc, q, "0x", utoa(u, 16, nbuf), width, left, zero);
                 break;
             default:
                 putc(q, *p);
@@ -159,6 +244,38 @@ int sprintf(char *buf, const char *fmt, ...) {
     return (p - buf);
 }
 
+/* struct bounded -- destination for snprintf */
+struct bounded {
+    char *p;                    /* Next free place */
+    int room;                   /* Characters that will still fit */
+    int count;                  /* Characters produced so far */
+};
+
+/* f_boundc -- putc-function that stores characters while there is room */
+static void f_boundc(void *q, char c) {
+    struct bounded *b = q;
+    if (b->room > 0) {
+        *(b->p)++ = c;
+        b->room--;
+    }
+    b->count++;
+}
+
+/* snprintf -- print to a character array of size n; return the length
+   of the complete output, even if it was truncated to fit */
+int snprintf(char *buf, int n, const char *fmt, ...) {
+    struct bounded b;
+    va_list va;
+
+    if (n <= 0) return 0;
+    b.p = buf; b.room = n-1; b.count = 0;
+    va_start(va, fmt);
+    _do_print(f_boundc, &b, fmt, va);
+    va_end(va);
+    *b.p = '\0';
+    return b.count;
+}
+
 /* printf's internal buffer complicates the behaviour of the 'chaos'
 example: don't be tempted to make the buffer bigger, or all chaos will
 be removed!  Clients not running under micro:bian see no benefit from
@@ -174,6 +291,7 @@ extern void print_buf(char *buf, int n);
 struct buffer {
     char buf[NBUF];             /* Characters in the buffer */
     int nbuf;                   /* Number of characters */
+    int count;                  /* Characters output in all */
 };
     
 /* flush -- flush a buffer by calling print_buf */
@@ -187,17 +305,19 @@ static void f_bufferc(void *q, char c) {
     struct buffer *b = q;
     if (b->nbuf == NBUF) flush(b);
     b->buf[b->nbuf++] = c;
+    b->count++;
 }
 
-/* printf -- print using client-supplied print_buf */
-void printf(const char *fmt, ...) {
+/* printf -- print using client-supplied print_buf; return count */
+int printf(const char *fmt, ...) {
     va_list va;
     struct buffer b;
-    b.nbuf = 0;
+    b.nbuf = b.count = 0;
     va_start(va, fmt);
     _do_print(f_bufferc, &b, fmt, va);
     va_end(va);
     if (b.nbuf > 0) flush(&b);
+    return b.count;
 }
 
 /* prandom -- pseudorandom numbers in the range [1 .. 2^31-1) */
@@ -8,12 +8,15 @@
 /* do_print -- the device-independent guts of printf */
 void do_print(void (*putch)(char), const char *fmt, va_list va);
 
-/* printf -- print using putchar */
-void printf(const char *fmt, ...);
+/* printf -- print using putchar; return number of characters */
+int printf(const char *fmt, ...);
 
 /* sprintf -- print to string buffer.  Note danger of overflow! */
 int sprintf(char *buf, const char *fmt, ...);
 
+/* snprintf -- print at most n-1 chars to string buffer and a null */
+int snprintf(char *buf, int n, const char *fmt, ...);
+
 /* atoi -- convert decimal string to int */
 int atoi(const char *p);
 
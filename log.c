@@ -0,0 +1,173 @@
+/* log.c */
+/* Copyright (c) 2026 J. M. Spivey */
+
+/* Deferred logging.  A call log_printf("x=%d\n", x) does not format
+anything on the device: the macro puts the format string in a section
+named logstr, and _log_event() records only its offset in that section
+and the values of the arguments, as a frame in a ring buffer.  A
+process started by log_init() sends the frames on the serial port, and
+the script logdump reads them back and formats the messages on the
+host, taking the format strings from the program:
+
+    ./logdump prog.elf log.bin
+
+Each frame is the byte LOG_SYNC, a count of the bytes that follow, the
+16-bit offset of the format, then the time in milliseconds since the
+previous frame and the arguments, each as a variable-length integer
+with 7 bits per byte and the top bit set in all but the last.
+Arguments are sign-folded (0, -1, 1, -2, ... become 0, 1, 2, 3, ...),
+so small values of either sign need only one byte.  The format may use
+%d, %u, %x, %c and the flags and widths of printf, but not %s, and each
+argument is taken as a 32-bit integer.  Other output on the serial
+port is all ASCII, and logdump copies it unchanged, so log_printf and
+printf can be used together.
+
+If the buffer is full, the frame is dropped and counted, and a frame
+with the offset LOG_LOST reports the count when there is room again.
+The drain process sends only whole frames, in writes of at most
+LOG_CHUNK bytes, so they are not split by output from other processes
+(see QUANTUM in serial.c), though characters echoed by the serial
+driver can still get between them.  When the buffer is empty, the
+process waits for an INTERRUPT message, which _log_event() sends with
+interrupt() when it adds the first frame.  Unlike post(), interrupt()
+leaves the message pending if the process is not yet waiting, so a
+frame added just after the process finds the buffer empty is not
+stranded. */
+
+#include "microbian.h"
+#include "hardware.h"
+#include <stdarg.h>
+
+#define LOG_BUF 512             /* Size of ring buffer: a power of 2 */
+#define LOG_SYNC 0xa5           /* First byte of every frame */
+#define LOG_LOST 0xffff         /* Format offset for lost frames */
+#define LOG_FRAME 40            /* Max frame size */
+#define LOG_CHUNK 64            /* Max bytes per write, <= QUANTUM */
+
+#define wrap(x) ((x) & (LOG_BUF-1))
+
+static byte ring[LOG_BUF];      /* Frames waiting to be sent */
+static int r_inp = 0;           /* In pointer */
+static int r_outp = 0;          /* Out pointer */
+static int r_count = 0;         /* Bytes in the buffer */
+static unsigned lost = 0;       /* Frames lost since last report */
+static unsigned last_time = 0;  /* Time of previous frame */
+static int LOG_TASK = 0;        /* The drain process, once started */
+
+/* The linker defines this for a section whose name is an identifier */
+extern const char __start_logstr[];
+
+/* put_varint -- encode an unsigned value in 7-bit groups */
+static byte *put_varint(byte *p, unsigned x)
+{
+    while (x >= 0x80) {
+        *p++ = (x & 0x7f) | 0x80;
+        x >>= 7;
+    }
+    *p++ = x;
+    return p;
+}
+
+/* put_frame -- add a frame to the ring buffer, if there is room */
+static int put_frame(unsigned id, int nargs, const int *args)
+{
+    byte frame[LOG_FRAME], *p = &frame[2];
+    unsigned now = timer_now();
+    int n;
+
+    *p++ = id & 0xff;
+    *p++ = id >> 8;
+    p = put_varint(p, now - last_time);
+    for (int i = 0; i < nargs; i++)
+        p = put_varint(p, ((unsigned) args[i] << 1) ^ (args[i] >> 31));
+    n = p - frame;
+    frame[0] = LOG_SYNC;
+    frame[1] = n - 2;
+
+    if (r_count + n > LOG_BUF) return 0;
+    for (int i = 0; i < n; i++) {
+        ring[r_inp] = frame[i];
+        r_inp = wrap(r_inp+1);
+    }
+    r_count += n;
+    last_time = now;
+    return 1;
+}
+
+/* _log_event -- record a frame for log_printf */
+void _log_event(const char *fmt, int nargs, ...)
+{
+    int args[LOG_MAXARGS];
+    va_list va;
+
+    va_start(va, nargs);
+    for (int i = 0; i < nargs; i++)
+        args[i] = va_arg(va, int);
+    va_end(va);
+
+    /* The buffer is shared with other processes and with interrupt
+       handlers, so we disable interrupts while we add the frame */
+    unsigned prev = get_primask();
+    intr_disable();
+
+    int was_empty = (r_count == 0);
+    if (lost > 0 && put_frame(LOG_LOST, 1, (int *) &lost))
+        lost = 0;
+    if (lost > 0 || ! put_frame(fmt - __start_logstr, nargs, args))
+        lost++;
+
+    /* Wake the drain process */
+    if (was_empty && r_count > 0 && LOG_TASK != 0)
+        interrupt(LOG_TASK);
+
+    set_primask(prev);
+}
+
+/* log_pending -- number of bytes waiting to be sent */
+int log_pending(void)
+{
+    return r_count;
+}
+
+/* take_frames -- copy whole frames from the buffer, up to LOG_CHUNK */
+static int take_frames(char *buf)
+{
+    int n = 0;
+
+    unsigned prev = get_primask();
+    intr_disable();
+
+    while (r_count > 0) {
+        int k = ring[wrap(r_outp+1)] + 2;
+        if (n + k > LOG_CHUNK) break;
+        for (int i = 0; i < k; i++) {
+            buf[n++] = ring[r_outp];
+            r_outp = wrap(r_outp+1);
+        }
+        r_count -= k;
+    }
+
+    set_primask(prev);
+    return n;
+}
+
+/* log_task -- send frames on the serial port */
+static void log_task(int arg)
+{
+    static char buf[LOG_CHUNK];
+    int n;
+
+    while (1) {
+        n = take_frames(buf);
+        if (n > 0)
+            serial_write(buf, n);
+        else
+            receive(INTERRUPT, NULL);
+    }
+}
+
+/* log_init -- start the process that sends the log */
+void log_init(void)
+{
+    LOG_TASK = start("Log", log_task, 0, 256);
+}
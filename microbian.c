@@ -15,6 +15,24 @@ void debug_sched(int pid);
 #define DEBUG_SCHED(pid)
 #endif
 
+#ifdef MICROBIAN_CHECK
+static void check_kernel(void);
+#define CHECK_KERNEL() check_kernel()
+#else
+#define CHECK_KERNEL()
+#endif
+
+#ifdef MICROBIAN_DEADLOCK
+#define CHECK_DEADLOCK(p) check_deadlock(p)
+#else
+#define CHECK_DEADLOCK(p)
+#endif
+
+/* The functions that are used on every system call and context
+switch are marked CODERAM (see hardware.h), so that with 'make
+RAMCODE=1' they are copied to RAM at startup.  Executing them from
+RAM avoids flash wait states. */
+
 
 /* PROCESS DESCRIPTORS */
 
@@ -39,6 +57,7 @@ struct _proc {
     int pending;              /* Whether HARDWARE message pending */
     int filter;               /* Message type accepted by receive */
     message *msgbuf;          /* Pointer to message buffer */
+    proc waitfor;             /* Destination of send, or source of reply */
 #ifdef _TIMEOUT
     int timeout;              /* Timeout for receive */
 #endif
@@ -110,6 +129,40 @@ static proc idle_proc;
 static void kprintf_setup(void);
 static void kprintf_internal(char *fmt, ...);
 
+#ifdef UBIT_V2
+static void idle_dump(void);
+#endif
+
+static proc blocker(proc p, int maybe);
+static void deadlock_dump(void);
+
+/* Supplied by timer.c if the program has periodic processes */
+period_stats *timer_period_stats(int pid) __attribute((weak));
+
+/* average -- mean of n samples with a given total, or 0 */
+static unsigned average(unsigned long long total, unsigned n)
+{
+    return (n == 0 ? 0 : total / n);
+}
+
+/* period_dump -- show timing of a periodic process */
+static void period_dump(int pid)
+{
+    period_stats *s;
+
+    if (! timer_period_stats) return;
+    s = timer_period_stats(pid);
+    if (s == NULL) return;
+
+    kprintf_internal("    every %ums: n=%u missed=%u over=%u\r\n",
+                     s->period, s->releases, s->missed, s->overruns);
+    kprintf_internal("    jitter max=%uus avg=%uus"
+                     " resp max=%uus avg=%uus\r\n",
+                     s->jitter_max,
+                     average(s->jitter_total, s->releases),
+                     s->resp_max, average(s->resp_total, s->done));
+}
+
 /* pad -- pad string with spaces to a specified width */
 static void pad(char *buf, int width)
 {
@@ -150,11 +203,21 @@ static void microbian_dump(void)
 
         sprintf(buf, "%u/%u", p->stksize-free, p->stksize);
         pad(buf, 9);
-        kprintf_internal("%s%d: %s %x stk=%s %s\r\n",
+        kprintf_internal("%s%d: %s %x stk=%s %s",
                          (pid < 10 ? " " : ""), pid,
                          status[p->state], (unsigned) p->stack,
                          buf, p->name);
+        if (blocker(p, 1) != NULL)
+            kprintf_internal(" -> %s", blocker(p, 1)->name);
+        kprintf_internal("\r\n");
+        period_dump(pid);
     }
+
+    deadlock_dump();
+
+#ifdef UBIT_V2
+    idle_dump();
+#endif
 }
 
 
@@ -168,7 +231,7 @@ static struct _queue {
 } os_readyq[NPRIO];
 
 /* make_ready -- add process to end of the ready queue for its priority */
-static inline void make_ready(proc p)
+static inline CODERAM void make_ready(proc p)
 {
     int prio = p->priority;
     if (prio == P_IDLE) return;
@@ -184,8 +247,18 @@ static inline void make_ready(proc p)
     q->tail = p;
 }
 
+#ifdef UBIT_V2
+static void idle_enter(void);
+static void idle_leave(void);
+#define IDLE_ENTER() idle_enter()
+#define IDLE_LEAVE() if (os_current == idle_proc) idle_leave()
+#else
+#define IDLE_ENTER()
+#define IDLE_LEAVE()
+#endif
+
 /* choose_proc -- the current process is blocked: pick a new one */
-static inline void choose_proc(void)
+static inline CODERAM void choose_proc(void)
 {
     for (int p = 0; p < NPRIO; p++) {
         queue q = &os_readyq[p];
@@ -197,11 +270,12 @@ static inline void choose_proc(void)
         }
     }
     os_current = idle_proc;
+    IDLE_ENTER();
     DEBUG_SCHED(0);
 }
 
 /* deliver_special -- devliver a special message and mark the recipient ready */
-static inline void deliver_special(proc pdst, int src, int type)
+static inline CODERAM void deliver_special(proc pdst, int src, int type)
 {
     message *buf = pdst->msgbuf;
     if (buf) {
@@ -237,7 +311,7 @@ static int ticks = 0;           /* Accumulated ticks since last update (ms) */
 static int next_time = NO_TIME; /* Earliest timeout due (could be -ve) */
 
 /* set_timeout -- schedule a timeout */
-static void set_timeout(int ms)
+static CODERAM void set_timeout(int ms)
 {
     int due = ticks + ms;
     assert(n_timeouts < NPROCS);
@@ -249,7 +323,7 @@ static void set_timeout(int ms)
 }
 
 /* cancel_timeout -- cancel a timeout before it is due */
-static void cancel_timeout(proc p)
+static CODERAM void cancel_timeout(proc p)
 {
     assert(p->timeout != NO_TIME);
     p->timeout = NO_TIME;
@@ -266,7 +340,7 @@ static void cancel_timeout(proc p)
 }
 
 /* mini-tick -- register a clock tick and fire any timeouts due */
-static void mini_tick(int ms)
+static CODERAM void mini_tick(int ms)
 {
     if (next_time == NO_TIME)
         /* No timers active */
@@ -304,20 +378,96 @@ static void mini_tick(int ms)
 #endif
 
 
+/* DEADLOCK DETECTION */
+
+/* Each blocked process waits for at most one other: a sender waits for
+the receiver whose queue it has joined, and a process that has done
+sendrec waits for a reply from the receiver.  A process waiting for
+a message from anyone waits for nobody in particular.  The waitfor
+fields make a graph with at most one edge out of each process.  A
+cycle of senders is a deadlock that will never be broken, because
+senders cannot time out.  The wait for a reply is weaker, because
+receive(REPLY) accepts a reply from any process, so a third process
+can break a cycle that includes one; such a cycle is only a possible
+deadlock.  The dump lists both kinds of cycle, and if
+MICROBIAN_DEADLOCK is defined, each system call that blocks follows
+the (usually short) chain of waiting senders and panics if the chain
+leads back to the caller. */
+
+/* blocker -- process that p is waiting for, or NULL; a process
+   waiting for a reply counts only if maybe is true */
+static proc blocker(proc p, int maybe)
+{
+    switch (p->state) {
+    case SENDING:
+    case SENDREC:
+        return p->waitfor;
+    case RECEIVING:
+        return (maybe ? p->waitfor : NULL);
+    default:
+        return NULL;
+    }
+}
+
+/* in_cycle -- test if p is waiting for itself, perhaps indirectly */
+static int in_cycle(proc p, int maybe)
+{
+    proc q = blocker(p, maybe);
+
+    for (int i = 0; q != NULL && i < os_nprocs; i++) {
+        if (q == p) return 1;
+        q = blocker(q, maybe);
+    }
+
+    return 0;
+}
+
+/* deadlock_dump -- print each cycle once, from its lowest pid */
+static void deadlock_dump(void)
+{
+    for (int pid = 0; pid < os_nprocs; pid++) {
+        proc p = os_ptable[pid], q;
+
+        if (! in_cycle(p, 1)) continue;
+        for (q = blocker(p, 1); q != p && q->pid > pid; q = blocker(q, 1)) { }
+        if (q != p) continue;
+
+        kprintf_internal("%s: %s",
+                         (in_cycle(p, 0) ? "DEADLOCK" : "POSSIBLE DEADLOCK"),
+                         p->name);
+        for (q = blocker(p, 1); q != p; q = blocker(q, 1))
+            kprintf_internal(" -> %s", q->name);
+        kprintf_internal(" -> %s\r\n", p->name);
+    }
+}
+
+#ifdef MICROBIAN_DEADLOCK
+/* check_deadlock -- panic if a newly blocked process closes a cycle
+   of senders */
+static void check_deadlock(proc p)
+{
+    if (in_cycle(p, 0)) {
+        microbian_dump();
+        panic("Deadlock");
+    }
+}
+#endif
+
+
 /* SEND AND RECEIVE */
 
 /* These versions of send and receive are invoked indirectly from user
 processes via the system calls send() and receive(). */
 
 /* accept -- test if a process is waiting for a message of given type */
-static inline int accept(proc pdest, int type)
+static inline CODERAM int accept(proc pdest, int type)
 {
     return (pdest->state == RECEIVING
             && (pdest->filter == ANY || pdest->filter == type));
 }
 
 /* deliver -- copy a message and make the destination ready */
-static inline void deliver(proc pdest, proc psrc)
+static inline CODERAM void deliver(proc pdest, proc psrc)
 {
     if (pdest->msgbuf) {
         *(pdest->msgbuf) = *(psrc->msgbuf);
@@ -327,8 +477,9 @@ static inline void deliver(proc pdest, proc psrc)
 }
 
 /* queue_sender -- add current process to a receiver's queue */
-static inline void queue_sender(proc pdest)
+static inline CODERAM void queue_sender(proc pdest)
 {
+    os_current->waitfor = pdest;
     os_current->next = NULL;
     if (pdest->waiting == NULL)
         pdest->waiting = os_current;
@@ -338,10 +489,12 @@ static inline void queue_sender(proc pdest)
             r = r->next;
         r->next = os_current;
     }
+
+    CHECK_DEADLOCK(os_current);
 }
 
 /* find_sender -- search process queue for acceptable sender */
-static proc find_sender(proc pdst, int type)
+static CODERAM proc find_sender(proc pdst, int type)
 {
     proc psrc, prev = NULL;
         
@@ -361,8 +514,8 @@ static proc find_sender(proc pdst, int type)
     return NULL;
 }
 
-/* await_reply -- wait for reply after sendrec */
-static void await_reply(proc pdst)
+/* await_reply -- wait for reply from psrv after sendrec */
+static CODERAM void await_reply(proc pdst, proc psrv)
 {
     proc psrc = find_sender(pdst, REPLY);
     if (psrc != NULL) {
@@ -373,10 +526,12 @@ static void await_reply(proc pdst)
     } else {
         pdst->state = RECEIVING;
         pdst->filter = REPLY;
+        pdst->waitfor = psrv;
+        CHECK_DEADLOCK(pdst);
     }
 }
 
-static inline proc find_dest(int dest)
+static inline CODERAM proc find_dest(int dest)
 {
     proc pdest;
 
@@ -392,7 +547,7 @@ static inline proc find_dest(int dest)
 }
 
 /* mini_send -- send a message */
-static void mini_send(int dest, message *msg)
+static CODERAM void mini_send(int dest, message *msg)
 {
     proc pdest = find_dest(dest);
 
@@ -416,7 +571,7 @@ static void mini_send(int dest, message *msg)
 }
 
 /* mini_receive -- receive a message */
-static void mini_receive(int type, message *msg
+static CODERAM void mini_receive(int type, message *msg
 #ifdef _TIMEOUT
                          , int timeout
 #endif
@@ -444,7 +599,7 @@ static void mini_receive(int type, message *msg
                 break;
 
             case SENDREC:
-                await_reply(psrc);
+                await_reply(psrc, os_current);
                 break;
 
             default:
@@ -467,6 +622,7 @@ static void mini_receive(int type, message *msg
     /* No luck: we must wait. */
     os_current->state = RECEIVING;
     os_current->filter = type;
+    os_current->waitfor = NULL;
 #ifdef _TIMEOUT
     if (timeout > 0) set_timeout(timeout);
 #endif
@@ -474,7 +630,7 @@ static void mini_receive(int type, message *msg
 }    
 
 /* mini_sendrec -- send a message and wait for reply */
-static void mini_sendrec(int dest, message *msg)
+static CODERAM void mini_sendrec(int dest, message *msg)
 {
     proc pdest = find_dest(dest);
 
@@ -485,8 +641,12 @@ static void mini_sendrec(int dest, message *msg)
 
     if (accept(pdest, msg->type)) {
         /* Send the message and wait for a reply */
+#ifdef _TIMEOUT
+        if (pdest->timeout != NO_TIME)
+            cancel_timeout(pdest);
+#endif
         deliver(pdest, os_current);
-        await_reply(os_current);
+        await_reply(os_current, pdest);
     } else {
         /* Join receiver's queue */
         os_current->state = SENDREC;
@@ -497,6 +657,110 @@ static void mini_sendrec(int dest, message *msg)
 }
 
 
+/* INVARIANT CHECKING */
+
+/* With MICROBIAN_CHECK defined, the kernel checks its data structures
+at the end of every system call, interrupt and context switch, and
+panics if they are inconsistent.  This makes each system call much
+slower, but stress.c uses it to look for bugs in the tricky cases of
+the code above. */
+
+#ifdef MICROBIAN_CHECK
+
+/* verify -- panic unless a condition holds */
+#define verify(cond, msg, pid) \
+    if (! (cond)) panic("Kernel check failed: %s (pid %d)", msg, pid)
+
+/* check_kernel -- check queues, process states and timeouts */
+static void check_kernel(void)
+{
+    static unsigned char queued[NPROCS];  /* Queues containing each proc */
+    proc p;
+    int n;
+
+    memset(queued, 0, sizeof(queued));
+
+    /* Ready queues contain active processes of the right priority */
+    for (int prio = 0; prio < NPRIO; prio++) {
+        queue q = &os_readyq[prio];
+        n = 0;
+        for (p = q->head; p != NULL; p = p->next) {
+            verify(n++ < os_nprocs, "cycle in ready queue", prio);
+            verify(p->state == ACTIVE, "inactive process is ready", p->pid);
+            verify(p->priority == prio, "ready at wrong priority", p->pid);
+            queued[p->pid]++;
+            if (p->next == NULL)
+                verify(q->tail == p, "bad ready queue tail", prio);
+        }
+    }
+
+    /* Send queues contain processes that are sending */
+    for (int pid = 0; pid < os_nprocs; pid++) {
+        n = 0;
+        for (p = os_ptable[pid]->waiting; p != NULL; p = p->next) {
+            verify(n++ < os_nprocs, "cycle in send queue", pid);
+            verify(p->state == SENDING || p->state == SENDREC,
+                   "queued process is not sending", p->pid);
+            verify(p->msgbuf != NULL, "sender has no message", p->pid);
+            verify(p->waitfor == os_ptable[pid],
+                   "sender waits for wrong process", p->pid);
+            queued[p->pid]++;
+        }
+    }
+
+    /* Each process is in the right number of queues for its state */
+    for (int pid = 0; pid < os_nprocs; pid++) {
+        p = os_ptable[pid];
+        verify(p->pid == pid, "bad process table", pid);
+
+        switch (p->state) {
+        case ACTIVE:
+            verify(queued[pid] == (p == os_current ? 0 : 1),
+                   "active process not ready", pid);
+            break;
+        case SENDING:
+        case SENDREC:
+            verify(queued[pid] == 1, "sender not queued", pid);
+            break;
+        case DEAD:
+        case RECEIVING:
+        case IDLING:
+            verify(queued[pid] == 0, "blocked process in a queue", pid);
+            break;
+        default:
+            verify(0, "bad state", pid);
+        }
+
+        verify(p != os_current || p->state == ACTIVE || p->state == IDLING,
+               "current process is blocked", pid);
+        verify(! (p->pending && accept(p, INTERRUPT)),
+               "interrupt not delivered", pid);
+#ifdef _TIMEOUT
+        verify(p->timeout == NO_TIME || p->state == RECEIVING,
+               "timeout set when not receiving", pid);
+#endif
+    }
+
+#ifdef _TIMEOUT
+    /* The timeout array lists each process with a timeout just once */
+    memset(queued, 0, sizeof(queued));
+    for (int j = 0; j < n_timeouts; j++) {
+        p = timeout[j];
+        verify(p->timeout != NO_TIME, "timeout listed but not set", p->pid);
+        verify(queued[p->pid]++ == 0, "timeout listed twice", p->pid);
+        verify(next_time != NO_TIME && next_time <= p->timeout,
+               "next_time is too late", p->pid);
+    }
+
+    for (int pid = 0; pid < os_nprocs; pid++)
+        verify(os_ptable[pid]->timeout == NO_TIME || queued[pid],
+               "timeout set but not listed", pid);
+#endif
+}
+
+#endif
+
+
 /* INTERRUPT HANDLING */
 
 /* Interrupts send an INTERRUPT message (from HARDWARE) to a
@@ -512,10 +776,26 @@ static int os_handler[N_INTERRUPTS];
 void connect(int irq)
 {
     if (irq < 0) panic("Can't connect to CPU exceptions");
+#ifdef UBIT_V2
+    if (GET_BYTE(NVIC_IPR[irq >> 2], irq & 0x3) < KERNEL_PRIO)
+        panic("Can't connect to urgent IRQ %d", irq);
+#endif
     os_current->priority = P_HANDLER;
     os_handler[irq] = os_current->pid;
 }
 
+#ifdef UBIT_V2
+/* irq_urgent -- raise an IRQ above the kernel at level [0..N_URGENT) */
+void irq_urgent(int irq, int level)
+{
+    if (irq < 0 || os_handler[irq] != 0)
+        panic("IRQ %d can't be made urgent", irq);
+    if (level < 0 || level >= N_URGENT)
+        panic("Bad urgent level %d", level);
+    irq_priority(irq, URGENT_PRIO(level));
+}
+#endif
+
 /* priority -- set process priority */
 void priority(int p)
 {
@@ -523,13 +803,30 @@ void priority(int p)
     os_current->priority = p;
 }
 
+/* current_pid -- pid of the running process, e.g. for a profiler */
+int current_pid(void)
+{
+    return os_current->pid;
+}
+
+/* proc_name -- name of process with given pid, or 0 if none */
+char *proc_name(int pid)
+{
+    if (pid < 0 || pid >= os_nprocs) return 0;
+    return os_ptable[pid]->name;
+}
+
 /* interrupt -- send interrupt message */
-void interrupt(int dest)
+CODERAM void interrupt(int dest)
 {
     proc pdest = find_dest(dest);
 
     if (accept(pdest, INTERRUPT)) {
         /* Receiver is waiting for an interrupt */
+#ifdef _TIMEOUT
+        if (pdest->timeout != NO_TIME)
+            cancel_timeout(pdest);
+#endif
         deliver_special(pdest, HARDWARE, INTERRUPT);
         make_ready(pdest);
         if (os_current->priority > P_HANDLER) {
@@ -540,6 +837,60 @@ void interrupt(int dest)
         /* Let's hope it's not urgent! */
         pdest->pending = 1;
     }
+
+    CHECK_KERNEL();
+}
+
+/* preempt -- reschedule if a process of higher priority than the
+   current one is ready.  Processes may be made ready while init() is
+   running, before there is a current process. */
+static inline CODERAM void preempt(void)
+{
+    if (os_current == NULL) return;
+
+    for (int p = 0; p < os_current->priority && p < NPRIO; p++) {
+        if (os_readyq[p].head != NULL) {
+            reschedule();
+            return;
+        }
+    }
+}
+
+/* Interrupt handlers that look after time, like the one in timer.c,
+use post() and tick_intr() in place of the system calls send() and
+tick(), and these cause a context switch only if some process is woken
+that should preempt the current one. */
+
+/* post -- deliver a message from HARDWARE if the receiver is waiting
+   for it, and return 1 if so */
+CODERAM int post(int dest, message *msg)
+{
+    proc pdest = find_dest(dest);
+
+    if (! accept(pdest, msg->type)) return 0;
+
+#ifdef _TIMEOUT
+    if (pdest->timeout != NO_TIME)
+        cancel_timeout(pdest);
+#endif
+    if (pdest->msgbuf) {
+        *(pdest->msgbuf) = *msg;
+        pdest->msgbuf->sender = HARDWARE;
+    }
+    make_ready(pdest);
+    preempt();
+    CHECK_KERNEL();
+    return 1;
+}
+
+/* tick_intr -- process clock tick for timeouts from a handler */
+CODERAM void tick_intr(int ms)
+{
+#ifdef _TIMEOUT
+    mini_tick(ms);
+    preempt();
+    CHECK_KERNEL();
+#endif
 }
 
 /* All interrupts are handled by this common handler, which disables
@@ -548,7 +899,7 @@ registered handler task.  Normally the handler task will deal with the
 cause of the interrupt, then re-enable it. */
 
 /* default_handler -- handler for most interrupts */
-void default_handler(void)
+CODERAM void default_handler(void)
 {
     int irq = active_irq(), task;
     if (irq < 0 || (task = os_handler[irq]) == 0)
@@ -609,6 +960,7 @@ static proc create_proc(char *name, unsigned stksize)
     p->timeout = NO_TIME;
 #endif
     p->msgbuf = NULL;
+    p->waitfor = NULL;
     p->next = NULL;
 
     return p;
@@ -629,14 +981,29 @@ static proc create_proc(char *name, unsigned stksize)
 
 #define roundup(x, n) (((x) + ((n)-1)) & ~((n)-1))
 
+#ifdef HOST
+/* Host processes need extra stack space for library calls and signal
+handlers */
+#define STACK_EXTRA 0x10000
+
+/* __fake_frame -- make initial frame for a process (see mpx-host.c) */
+unsigned *__fake_frame(unsigned *sp, void (*body)(int), int arg,
+                       void (*exit)(void));
+#else
+#define STACK_EXTRA 0
+#endif
+
 /* start -- initialise a process to run later */
 int start(char *name, void (*body)(int), int arg, int stksize)
 {
-    proc p = create_proc(name, roundup(stksize, 8));
+    proc p = create_proc(name, roundup(stksize, 8) + STACK_EXTRA);
 
     if (os_current != NULL)
         panic("start() called after scheduler startup");
 
+#ifdef HOST
+    p->sp = __fake_frame(p->sp, body, arg, exit);
+#else
     /* Fake an exception frame */
     unsigned *sp = p->sp - FRAME_WORDS;
     memset(sp, 0, 4*FRAME_WORDS);
@@ -646,6 +1013,7 @@ int start(char *name, void (*body)(int), int arg, int stksize)
     sp[R0_SAVE] = (unsigned) arg;  /* Pass the supplied argument in R0 */
     sp[ERV_SAVE] = MAGIC;
     p->sp = sp;
+#endif
 
     make_ready(p);
     return p->pid;
@@ -657,6 +1025,8 @@ void __run(void (*task)(void), unsigned *sp);
 /* init -- main program, creates application processes */
 void init(void);
 
+#ifndef UBIT_V2
+
 #define IDLE_STACK 128
 
 /* idle_task -- body of idle process */
@@ -669,11 +1039,248 @@ static void idle_task(void)
     while (1) pause();
 }    
 
+/* idle_latency -- no choice of idle mode on V1 */
+void idle_latency(int usec)
+{
+}
+
+#else
+
+/* IDLE POLICY */
+
+/* On V2, waking from WFE in the default low-power mode takes long
+enough to upset some applications, so each time round its loop the
+idle process chooses one of three ways to wait:
+
+    IDLE_BUSY      spin, with no wakeup delay but at full power;
+    IDLE_CONSTLAT  WFE with the POWER peripheral in constant-latency
+                   mode, which keeps regulators and clocks ready;
+    IDLE_LOWPOWER  WFE in low-power mode, cheapest but slowest.
+
+Until the application sets a latency budget with idle_latency(), the
+idle process always spins, as it did before there was a choice.  With
+a budget, it picks the deepest mode whose estimated wakeup latency
+fits, but spins if the next timer or timeout is due too soon for
+sleeping to pay; with no limit, it always uses the low-power mode.
+The estimate for each mode starts from a conservative guess and
+follows a moving average of the latencies measured in that mode, so
+that a single slow wakeup (after a long critical section, say) does
+not rule the mode out for good.  A mode that is not in use has no
+measurements, so its estimate drifts slowly back towards the guess,
+and if that brings it within the budget, the mode is tried again.
+
+The timer driver, if it is linked in, provides timer_next() to say
+when its next timer is due, and calls idle_wakeup() from each tick
+interrupt with the time since the compare event.  Time spent idle in
+each mode is measured with timer_micros(), and the statistics appear
+in the process dump.  Weak references let the kernel work without the
+timer, but then the only information is the choice of mode. */
+
+#define IDLE_STACK 256
+
+#define IDLE_BUSY 0
+#define IDLE_CONSTLAT 1
+#define IDLE_LOWPOWER 2
+#define N_IDLE 3
+
+#define IDLE_UNSET -2           /* Budget until idle_latency is called */
+#define IDLE_NOLIMIT -1         /* Budget for no latency limit */
+#define IDLE_MIN_SLEEP 50       /* Spin if an event is due sooner (usec) */
+
+/* Latency estimates are fixed-point with EST_FRAC fraction bits; each
+   sample moves the estimate for its mode 1/2^EST_GAIN of the way
+   towards it, and each moves the others 1/2^EST_AGE of the way back
+   towards their initial guess */
+#define EST_FRAC 4
+#define EST_GAIN 3
+#define EST_AGE 6
+
+unsigned timer_micros(void) __attribute((weak));
+int timer_next(void) __attribute((weak));
+
+static int idle_budget = IDLE_UNSET;
+static int idle_mode = IDLE_LOWPOWER; /* The reset state of POWER */
+static unsigned idle_mark;      /* Time of last update to statistics */
+static unsigned idle_epoch;     /* Time statistics started */
+static int idle_started = 0;    /* Whether idle_epoch is set */
+
+/* idle_stats -- time and wakeup latency for each mode */
+static struct {
+    unsigned long long time;    /* Total time in the mode (usec) */
+    unsigned latency;           /* Worst observed wakeup latency (usec) */
+    int estimate;               /* Expected latency (fixed point) */
+    unsigned samples;           /* Number of latency samples */
+    unsigned total;             /* Sum of latency samples */
+} idle_stats[N_IDLE];
+
+/* idle_estimate -- assumed latency for each mode until measured */
+static const unsigned idle_estimate[N_IDLE] = { 0, 2, 20 };
+
+/* idle_clock -- current time in usec if the timer is available */
+static inline unsigned idle_clock(void)
+{
+    return (timer_micros ? timer_micros() : 0);
+}
+
+/* idle_account -- charge time since idle_mark to the current mode */
+static void idle_account(void)
+{
+    unsigned now = idle_clock();
+    idle_stats[idle_mode].time += now - idle_mark;
+    idle_mark = now;
+}
+
+/* idle_enter -- called by choose_proc when the idle process is chosen */
+static void idle_enter(void)
+{
+    idle_mark = idle_clock();
+    if (! idle_started) {
+        idle_epoch = idle_mark;
+        idle_started = 1;
+        for (int i = 0; i < N_IDLE; i++)
+            idle_stats[i].estimate = idle_estimate[i] << EST_FRAC;
+    }
+}
+
+/* idle_leave -- called when the idle process is preempted */
+static void idle_leave(void)
+{
+    idle_account();
+}
+
+/* idle_latency -- set the wakeup latency the application can tolerate,
+   or -1 for no limit */
+void idle_latency(int usec)
+{
+    idle_budget = usec;
+}
+
+/* idle_wakeup -- record wakeup latency measured by a timer interrupt */
+void idle_wakeup(unsigned usec)
+{
+    if (os_current != idle_proc) return;
+
+    idle_stats[idle_mode].samples++;
+    idle_stats[idle_mode].total += usec;
+    if (usec > idle_stats[idle_mode].latency)
+        idle_stats[idle_mode].latency = usec;
+
+    for (int i = 0; i < N_IDLE; i++) {
+        int *est = &idle_stats[i].estimate;
+        if (i == idle_mode)
+            *est += ((int) (usec << EST_FRAC) - *est) >> EST_GAIN;
+        else
+            *est += ((int) (idle_estimate[i] << EST_FRAC) - *est) >> EST_AGE;
+    }
+}
+
+/* wakeup_time -- expected wakeup latency for a mode, rounded up */
+static int wakeup_time(int mode)
+{
+    return (idle_stats[mode].estimate + (1 << EST_FRAC) - 1) >> EST_FRAC;
+}
+
+/* idle_choose -- pick the deepest acceptable mode */
+static int idle_choose(void)
+{
+    int due = -1;               /* Time to next event (usec) or -1 */
+
+    if (idle_budget == IDLE_UNSET) return IDLE_BUSY;
+    if (idle_budget < 0) return IDLE_LOWPOWER;
+
+    if (timer_next) due = timer_next();
+
+#ifdef _TIMEOUT
+    if (next_time != NO_TIME) {
+        int t = 1000 * (next_time - ticks);
+        if (due < 0 || t < due) due = t;
+    }
+#endif
+
+    if (due >= 0 && due < IDLE_MIN_SLEEP)
+        return IDLE_BUSY;
+    if (wakeup_time(IDLE_LOWPOWER) <= idle_budget)
+        return IDLE_LOWPOWER;
+    if (wakeup_time(IDLE_CONSTLAT) <= idle_budget)
+        return IDLE_CONSTLAT;
+    return IDLE_BUSY;
+}
+
+/* idle_task -- body of idle process */
+static void idle_task(void)
+{
+    /* Pick a genuine process to run */
+    yield();
+
+    /* Idle only runs again when there's nothing to do. */
+    while (1) {
+        int mode = idle_choose();
+
+        if (mode != idle_mode) {
+            /* Close the books on the old mode without being preempted */
+            intr_disable();
+            idle_account();
+            idle_mode = mode;
+            intr_enable();
+
+            if (mode == IDLE_CONSTLAT)
+                POWER_CONSTLAT = 1;
+            else
+                POWER_LOWPWR = 1;
+        }
+
+        if (mode != IDLE_BUSY)
+            asm volatile ("wfe");
+    }
+}
+
+/* percent -- compute 100 * a / b safely */
+static int percent(unsigned long long a, unsigned long long b)
+{
+    return (b == 0 ? 0 : (100 * a) / b);
+}
+
+/* idle_dump -- show idle statistics */
+static void idle_dump(void)
+{
+    static const char *mode_name[N_IDLE] = {
+        "busy", "constlat", "lowpower"
+    };
+
+    if (! idle_started) return;
+
+    if (os_current == idle_proc) idle_account();
+    unsigned long long elapsed = idle_clock() - idle_epoch;
+    unsigned long long total = 0;
+    for (int i = 0; i < N_IDLE; i++) total += idle_stats[i].time;
+
+    kprintf_internal("IDLE %d%% of %ums, ",
+                     percent(total, elapsed), (unsigned) (elapsed/1000));
+    if (idle_budget == IDLE_UNSET)
+        kprintf_internal("no budget\r\n");
+    else if (idle_budget < 0)
+        kprintf_internal("no limit\r\n");
+    else
+        kprintf_internal("budget %dus\r\n", idle_budget);
+
+    for (int i = 0; i < N_IDLE; i++) {
+        unsigned n = idle_stats[i].samples;
+        kprintf_internal("  %s: %d%% wakeup max=%uus avg=%uus "
+                         "est=%dus n=%u\r\n",
+                         mode_name[i], percent(idle_stats[i].time, elapsed),
+                         idle_stats[i].latency,
+                         (n == 0 ? 0 : idle_stats[i].total / n),
+                         wakeup_time(i), n);
+    }
+}
+
+#endif
+
 /* __start -- start the operating system */
 void __start(void)
 {
     /* Create idle task as process 0 */
-    idle_proc = create_proc("IDLE", IDLE_STACK);
+    idle_proc = create_proc("IDLE", IDLE_STACK + STACK_EXTRA);
     idle_proc->state = IDLING;
     idle_proc->priority = P_IDLE;
 
@@ -704,13 +1311,20 @@ was saved by the SVC instruction on entry to the operating system.  We
 can't rely on the arguments still being in r0, r1, etc., because an
 interrupt may have intervened and trashed these registers. */
 
+#ifndef HOST
+/* Syscall number from svc instruction */
+#define sysop(psp) (((short *) psp[PC_SAVE])[-1] & 0xff)
 #define sysarg(i, t) ((t) psp[R0_SAVE+(i)])
+#else
+/* The host frame has the syscall number and arguments as longs */
+#define sysop(psp) ((int) ((long *) psp)[0])
+#define sysarg(i, t) ((t) ((long *) psp)[1+(i)])
+#endif
 
 /* system_call -- entry from system call traps */
-unsigned *system_call(unsigned *psp)
+CODERAM unsigned *system_call(unsigned *psp)
 {
-    short *pc = (short *) psp[PC_SAVE]; /* Program counter */
-    int op = pc[-1] & 0xff;      /* Syscall number from svc instruction */
+    int op = sysop(psp);
 
     /* Save sp of the current process */
     os_current->sp = psp;
@@ -768,16 +1382,20 @@ unsigned *system_call(unsigned *psp)
         panic("Unknown syscall %d", op);
     }
 
+    CHECK_KERNEL();
+
     /* Return sp for next process to run */
     return os_current->sp;
 }
 
 /* cxt_switch -- context switch following interrupt */
-unsigned *cxt_switch(unsigned *psp)
+CODERAM unsigned *cxt_switch(unsigned *psp)
 {
     os_current->sp = psp;
+    IDLE_LEAVE();
     make_ready(os_current);
     choose_proc();
+    CHECK_KERNEL();
     return os_current->sp;
 }
 
@@ -789,6 +1407,8 @@ prevent GCC's optimiser from messing them up.  Without it, the
 assembly instructions would need to be laboriously annotated with
 what registers and memory they read and write. */
 
+#ifndef HOST
+
 #define SYSCALL      __attribute__((naked))
 #define syscall(op)  asm ("svc %0; bx lr" : : "i"(op))
 
@@ -832,6 +1452,58 @@ void SYSCALL tick(int ms)
     syscall(SYS_TICK);
 }
 
+#else
+
+/* On the host, system calls go through __svc() in mpx-host.c, which
+saves the arguments in a frame. */
+
+void __svc(int op, long arg0, long arg1, long arg2);
+
+#define syscall(op, a0, a1, a2) \
+    __svc(op, (long) (a0), (long) (a1), (long) (a2))
+
+void yield(void)
+{
+    syscall(SYS_YIELD, 0, 0, 0);
+}
+
+void send(int dest, message *msg)
+{
+    syscall(SYS_SEND, dest, msg, 0);
+}
+
+void receive(int type, message *msg)
+{
+    syscall(SYS_RECEIVE, type, msg, 0);
+}
+
+void sendrec(int dest, message *msg)
+{
+    syscall(SYS_SENDREC, dest, msg, 0);
+}
+
+void exit(void)
+{
+    syscall(SYS_EXIT, 0, 0, 0);
+}
+
+void dump(void)
+{
+    syscall(SYS_DUMP, 0, 0, 0);
+}
+
+void receive_t(int type, message *msg, int timeout)
+{
+    syscall(SYS_RECEIVET, type, msg, timeout);
+}
+
+void tick(int ms)
+{
+    syscall(SYS_TICK, ms, 0, 0);
+}
+
+#endif
+
 void send_msg(int dest, int type)
 {
     message m;
@@ -872,20 +1544,71 @@ static void delay_usec(int usec)
     }
 }
         
+/* uart_rates -- settings of the BAUDRATE register, the same on both
+   boards for the UART and the UARTE */
+static const struct {
+    int baud;
+    unsigned setting;
+} uart_rates[] = {
+    { 1200, UART_BAUDRATE_1200 },
+    { 2400, UART_BAUDRATE_2400 },
+    { 4800, UART_BAUDRATE_4800 },
+    { 9600, UART_BAUDRATE_9600 },
+    { 14400, UART_BAUDRATE_14400 },
+    { 19200, UART_BAUDRATE_19200 },
+    { 28800, UART_BAUDRATE_28800 },
+    { 38400, UART_BAUDRATE_38400 },
+    { 57600, UART_BAUDRATE_57600 },
+    { 115200, UART_BAUDRATE_115200 },
+    { 230400, UART_BAUDRATE_230400 },
+    { 250000, UART_BAUDRATE_250000 },
+    { 460800, UART_BAUDRATE_460800 },
+    { 921600, UART_BAUDRATE_921600 },
+    { 1000000, UART_BAUDRATE_1M },
+    { 0, 0 }
+};
+
+/* uart_baudrate -- BAUDRATE setting for a rate, or 0 if unsupported */
+unsigned uart_baudrate(int baud)
+{
+    for (int i = 0; uart_rates[i].baud != 0; i++) {
+        if (uart_rates[i].baud == baud)
+            return uart_rates[i].setting;
+    }
+    return 0;
+}
+
+/* The serial driver calls kprintf_config() whenever its settings
+change, so that debugging output and panic messages can be read with
+the same terminal settings. */
+
+static int kprintf_baud = SERIAL_BAUD;
+static int kprintf_flags = 0;
+
+/* kprintf_config -- set baud rate and format for kprintf and panic */
+void kprintf_config(int baud, int flags)
+{
+    if (uart_baudrate(baud) == 0)
+        panic("Unsupported baud rate %d", baud);
+    kprintf_baud = baud;
+    kprintf_flags = flags;
+}
+
 /* kprintf_setup -- set up UART connection to host */
 static void kprintf_setup(void)
 {
-    /* Delay so any UART activity can cease */
-    delay_usec(2000);
+    /* Delay for two character times so any UART activity can cease */
+    delay_usec(20000000 / kprintf_baud);
 
     /* Set up pins to maintain signal levels while UART disabled */
     gpio_dir(USB_TX, 1); gpio_dir(USB_RX, 0); gpio_out(USB_TX, 1);
 
     /* Reconfigure the UART just to be sure */
     UART_ENABLE = UART_ENABLE_Disabled;
-    UART_BAUDRATE = UART_BAUDRATE_9600; /* 9600 baud */
-    UART_CONFIG = FIELD(UART_CONFIG_PARITY, UART_PARITY_None);
-                                        /* format 8N1 */
+    UART_BAUDRATE = uart_baudrate(kprintf_baud);
+    UART_CONFIG = FIELD(UART_CONFIG_PARITY,
+                        (kprintf_flags & SERIAL_PARITY ?
+                         UART_PARITY_Even : UART_PARITY_None));
     UART_PSELTXD = USB_TX;              /* choose pins */
     UART_PSELRXD = USB_RX;
     UART_ENABLE = UART_ENABLE_Enabled;
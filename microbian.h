@@ -76,6 +76,12 @@ void connect(int irq);
 /* priority -- set process priority */
 void priority(int p);
 
+/* current_pid -- pid of the running process */
+int current_pid(void);
+
+/* proc_name -- name of a process for debugging, or 0 */
+char *proc_name(int pid);
+
 /* exit -- terminate current process */
 void exit(void);
 
@@ -88,9 +94,31 @@ void tick(int ms);
 /* interrupt -- send interrupt message from handler */
 void interrupt(int pid);
 
+/* post -- deliver message from handler if receiver is waiting; 1 if so */
+int post(int dest, message *msg);
+
+/* tick_intr -- process clock tick for timeouts from handler */
+void tick_intr(int ms);
+
+/* irq_urgent -- give an IRQ priority above the kernel (V2 only) */
+void irq_urgent(int irq, int level);
+
+/* idle_latency -- set wakeup latency (usec) tolerated when idle, or -1
+   for no limit; until it is called, idle spins (V2) */
+void idle_latency(int usec);
+
+/* idle_wakeup -- report wakeup latency to the idle policy (from timer) */
+void idle_wakeup(unsigned usec);
+
 /* kprintf -- print message on console without using serial task */
 void kprintf(char *fmt, ...);
 
+/* kprintf_config -- set baud rate and flags for kprintf and panic */
+void kprintf_config(int baud, int flags);
+
+/* uart_baudrate -- BAUDRATE register setting for a rate, or 0 */
+unsigned uart_baudrate(int baud);
+
 /* panic -- crash with message and show seven stars */
 void panic(char *fmt, ...);
 
@@ -106,17 +134,62 @@ void badmesg(int type);
 void spin(void);
 
 /* serial.c */
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD 9600        /* Default rate: see BAUD in Makefile */
+#endif
+#define SERIAL_PARITY 0x1       /* Flag for even parity */
+#define SERIAL_RAW 0x2          /* Flag for input without editing */
+void serial_config(int baud, int flags);
+int serial_read(char *buf, int n, int timeout);
+void serial_write(const char *buf, int n);
+void print_buf(char *buf, int n);
 void serial_putc(char ch);
 char serial_getc(void);
 void serial_init(void);
+void uart_config(int u, int baud, int flags);
+int uart_read(int u, char *buf, int n, int timeout);
+void uart_write(int u, const char *buf, int n);
+void uart_print(int u, const char *buf, int n);
+void uart_putc(int u, char ch);
+char uart_getc(int u);
+void uart_init(int u, int timer);
 
 /* timer.c */
 void timer_delay(int msec);
-void timer_pulse(int msec);
+int timer_pulse(int msec);
+int timer_once(int msec);
+int timer_cancel(int h);
+int timer_modify(int h, int msec, int repeat);
+int timer_slack(int h, int msec);
+void timer_wakeups(unsigned *wakeups, unsigned *saved);
 void timer_wait(void);
 unsigned timer_now(void);
 unsigned timer_micros(void);
+int timer_next(void);
 void timer_init(void);
+unsigned timer_ucount(void);
+unsigned long long timer_clock(void);
+void timer_uwait(unsigned when);
+void timer_udelay(unsigned usec);
+void timer_ustats(unsigned *count, unsigned *mean, unsigned *worst);
+void timer_xtal(int on);
+
+/* period_stats -- timing of a periodic process (usec except period) */
+typedef struct {
+    unsigned period;            /* Period (ms) */
+    unsigned releases;          /* Number of releases */
+    unsigned missed;            /* Releases skipped after overruns */
+    unsigned done;              /* Jobs finished */
+    unsigned overruns;          /* Jobs that took longer than a period */
+    unsigned jitter_max;        /* Worst lateness in starting a job */
+    unsigned long long jitter_total; /* Sum of lateness */
+    unsigned resp_max;          /* Worst time from release to finish */
+    unsigned long long resp_total; /* Sum of response times */
+} period_stats;
+
+void timer_periodic(int msec);
+int wait_next_period(void);
+period_stats *timer_period_stats(int pid);
 
 /* i2c.c */
 int i2c_probe(int chan, int addr);
@@ -145,3 +218,24 @@ void image_set(int x, int y, unsigned *img);
 /* adc.c */
 int adc_reading(int pin);
 void adc_init(void);
+
+/* log.c */
+#define LOG_MAXARGS 6
+#define log_printf(fmt, ...)                                            \
+    do {                                                                \
+        static const char _fmt[] __attribute((section("logstr"))) = fmt; \
+        _log_event(_fmt, _log_nargs(__VA_ARGS__), ## __VA_ARGS__);      \
+    } while (0)
+#define _log_nargs(...) \
+    _log_nth(_, ## __VA_ARGS__, _log_too_many_args, _log_too_many_args, \
+             _log_too_many_args, _log_too_many_args, 6, 5, 4, 3, 2, 1, 0)
+#define _log_nth(_, a, b, c, d, e, f, g, h, i, j, n, ...) n
+void _log_event(const char *fmt, int nargs, ...);
+int log_pending(void);
+void log_init(void);
+
+/* profile.c */
+void profile_start(int hz);
+void profile_stop(void);
+void profile_clear(void);
+void profile_dump(void);
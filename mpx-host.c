@@ -0,0 +1,120 @@
+/* mpx-host.c */
+/* Copyright (c) 2026 J. M. Spivey */
+
+/* Process multiplexing for the host port, using the ucontext functions
+of the C library in place of the exception frames of mpx-m0.s.
+
+A system call saves its number and arguments in a frame on the stack
+of the calling process, and passes the address of the frame to
+system_call() in microbian.c, which returns the frame of the next
+process to run.  If that is a different process, the machine state is
+saved in the frame and swapped for the state saved in the other one.
+A process that is preempted by an interrupt is suspended in the same
+way by pendsv_handler(), called from the signal handler for
+interrupts in host/startup.c.  The frame of a new process is made by
+__fake_frame(), and when the process is first chosen, it begins by
+calling the process body.
+
+System calls run with interrupts disabled, as they do on the chip.
+Each process has its own signal mask in its saved state, so the mask
+is restored correctly when a process is resumed. */
+
+#include <signal.h>
+#include <ucontext.h>
+
+#include "hardware.h"
+
+/* Frame layout: the words before the context are known to sysop()
+and sysarg() in microbian.c */
+struct frame {
+    long op;                    /* System call number */
+    long arg[3];                /* Arguments */
+    ucontext_t context;         /* Saved machine state */
+};
+
+unsigned *system_call(unsigned *psp);
+unsigned *cxt_switch(unsigned *psp);
+
+/* The ucontext functions use only the top of the stack that is
+specified, so the size we give is nominal. */
+#define STACK_TOP(c, sp) \
+    ((c)->uc_stack.ss_sp = (char *) (sp) - 1024, \
+     (c)->uc_stack.ss_size = 1024)
+
+/* switch_to -- swap states if next is a different frame */
+static void switch_to(struct frame *f, struct frame *next)
+{
+    if (next != f)
+        swapcontext(&f->context, &next->context);
+}
+
+/* __svc -- system call */
+void __svc(int op, long arg0, long arg1, long arg2)
+{
+    struct frame f;
+    unsigned prev = get_primask();
+
+    intr_disable();
+    f.op = op;
+    f.arg[0] = arg0;
+    f.arg[1] = arg1;
+    f.arg[2] = arg2;
+    switch_to(&f, (struct frame *) system_call((unsigned *) &f));
+    set_primask(prev);
+}
+
+/* pendsv_handler -- context switch following interrupt */
+void pendsv_handler(void)
+{
+    struct frame f;
+    switch_to(&f, (struct frame *) cxt_switch((unsigned *) &f));
+}
+
+/* body -- run a process body, passing the frame address in two halves */
+static void body(unsigned hi, unsigned lo)
+{
+    struct frame *f =
+        (struct frame *) (((unsigned long) hi << 32) | lo);
+    void (*fun)(int) = (void (*)(int)) f->arg[0];
+    void (*exit)(void) = (void (*)(void)) f->arg[2];
+
+    fun((int) f->arg[1]);
+    exit();
+}
+
+/* __fake_frame -- make a frame below sp for a new process */
+unsigned *__fake_frame(unsigned *sp, void (*fun)(int), int arg,
+                       void (*exit)(void))
+{
+    unsigned long top = (unsigned long) sp - sizeof(struct frame);
+    struct frame *f = (struct frame *) (top & ~0xfUL);
+    unsigned long addr = (unsigned long) f;
+
+    f->op = -1;
+    f->arg[0] = (long) fun;
+    f->arg[1] = arg;
+    f->arg[2] = (long) exit;
+
+    /* The process starts with interrupts enabled */
+    getcontext(&f->context);
+    f->context.uc_link = 0;
+    sigemptyset(&f->context.uc_sigmask);
+    STACK_TOP(&f->context, f);
+    makecontext(&f->context, (void (*)(void)) body, 2,
+                (unsigned) (addr >> 32), (unsigned) addr);
+
+    return (unsigned *) f;
+}
+
+/* __run -- enter process mode with specified stack */
+void __run(void (*task)(void), unsigned *sp)
+{
+    static ucontext_t context;
+
+    getcontext(&context);
+    context.uc_link = 0;
+    sigemptyset(&context.uc_sigmask);
+    STACK_TOP(&context, sp);
+    makecontext(&context, task, 0);
+    setcontext(&context);
+}
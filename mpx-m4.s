@@ -56,6 +56,13 @@ __run:
     bx r3
     .endm
 
+@@@ With RAMCODE defined, the handlers go in the .xram section, which
+@@@ is copied to RAM at startup along with the kernel's hot path.
+    .ifdef RAMCODE
+    .section .xram, "ax", %progbits
+    .align 2
+    .endif
+
 @@@ svc_handler -- handler for SVC interrupt (system call)
     .global svc_handler
     .thumb_func
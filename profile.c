@@ -0,0 +1,177 @@
+/* profile.c */
+/* Copyright (c) 2026 J. M. Spivey */
+
+/* A statistical profiler.  A spare timer interrupts at a steady rate,
+and the handler records the PC of the interrupted process, taken from
+the exception frame that the hardware pushed on the process stack,
+together with the pid of the current process.  The PCs are counted in
+a histogram of NBUCKETS equal buckets that cover the program text, and
+profile_dump() prints the non-empty buckets on the serial port.
+Capture the output, and use the script profsym to match it up with
+the symbol table of the program:
+
+    ./profsym ex-echo.elf log.txt
+
+The timer interrupt has the same priority as the others, so it cannot
+interrupt the kernel or another interrupt handler: a sample that falls
+due then is taken as soon as the process is resumed, and charged to
+it.  The timer runs freely, and each sample moves the compare register
+on by one interval.  To avoid keeping step with periodic activity such
+as the timer tick, the interval is jittered by up to 1/4 of its
+length.  Code that runs from RAM (see RAMCODE in the Makefile) lies
+outside the histogram, and is counted separately. */
+
+#include "microbian.h"
+#include "hardware.h"
+#include "lib.h"
+
+/* Timer 0 is used for microsecond timers in timer.c, and Timer 1 for
+the clock, so we use Timer 2 on both boards. */
+#define PTIMER 2
+#define PTIMER_IRQ TIMER2_IRQ
+#define profile_handler timer2_handler
+
+/* Buckets in PC histogram */
+#ifdef UBIT_V1
+#define NBUCKETS 512
+#endif
+
+#ifdef UBIT_V2
+#define NBUCKETS 2048
+#endif
+
+#define NPIDS 32                /* At least NPROCS in microbian.c */
+
+static unsigned short hist[NBUCKETS]; /* Samples by PC */
+static unsigned pid_count[NPIDS]; /* Samples by process */
+static unsigned total = 0;      /* Total samples */
+static unsigned outside = 0;    /* Samples outside program text */
+
+static unsigned text_base;      /* Address of first bucket */
+static int shift;               /* log2 of bucket size */
+static int prof_hz = 0;         /* Sampling rate */
+static int running = 0;         /* Whether sampling is enabled */
+static unsigned period;         /* Mean sample interval (usec) */
+static unsigned jmask;          /* Mask for random part of interval */
+static unsigned seed = 1;       /* State of random generator */
+
+#ifdef HOST
+extern char __executable_start[], __etext[];
+#define TEXT_START ((unsigned) __executable_start)
+#else
+extern char __etext[];
+#define TEXT_START 0
+#endif
+
+/* interrupted_pc -- PC where the current process was interrupted */
+static inline unsigned interrupted_pc(void)
+{
+#ifdef HOST
+    return cpu_irq_pc;
+#else
+    unsigned *psp;
+    asm volatile ("mrs %0, psp" : "=r" (psp));
+    return psp[6];              /* After r0-r3, r12, lr */
+#endif
+}
+
+/* profile_handler -- take a sample and set the next interval */
+void profile_handler(void)
+{
+    volatile struct _timer *t = TIMER[PTIMER];
+
+    if (t->COMPARE[0]) {
+        unsigned b = (interrupted_pc() - text_base) >> shift;
+        int pid = current_pid();
+
+        t->COMPARE[0] = 0;
+        total++;
+        if (pid < NPIDS) pid_count[pid]++;
+        if (b < NBUCKETS) {
+            if (hist[b] < 0xffff) hist[b]++;
+        } else {
+            outside++;
+        }
+
+        /* Choose the next interval with an xorshift generator */
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        t->CC[0] = (t->CC[0] + period - (jmask+1)/2 + (seed & jmask))
+            & 0xffff;
+    }
+}
+
+/* profile_clear -- discard samples taken so far */
+void profile_clear(void)
+{
+    disable_irq(PTIMER_IRQ);
+    for (int i = 0; i < NBUCKETS; i++) hist[i] = 0;
+    for (int i = 0; i < NPIDS; i++) pid_count[i] = 0;
+    total = outside = 0;
+    if (running) enable_irq(PTIMER_IRQ);
+}
+
+/* profile_start -- start taking samples at hz per second */
+void profile_start(int hz)
+{
+    volatile struct _timer *t = TIMER[PTIMER];
+    unsigned size = (unsigned) __etext - TEXT_START;
+
+    /* The 16-bit count at 1MHz allows rates down to 16Hz; on V1,
+       Timer 2 has only 16 bits anyway. */
+    if (hz < 16 || hz > 100000) panic("Bad profiling rate %d", hz);
+    prof_hz = hz;
+    running = 1;
+    period = 1000000 / hz;
+    jmask = 1;
+    while (jmask < period/8) jmask = (jmask << 1) + 1;
+
+    text_base = TEXT_START;
+    shift = 2;
+    while ((size >> shift) >= NBUCKETS) shift++;
+
+    t->STOP = 1;
+    t->MODE = TIMER_MODE_Timer;
+    t->BITMODE = TIMER_BITMODE_16Bit;
+    t->PRESCALER = 4;           /* 1MHz = 16MHz / 2^4 */
+    t->CLEAR = 1;
+    t->CC[0] = period;
+    t->SHORTS = 0;
+    t->INTENSET = BIT(TIMER_INT_COMPARE0);
+    t->START = 1;
+    enable_irq(PTIMER_IRQ);
+}
+
+/* profile_stop -- stop taking samples */
+void profile_stop(void)
+{
+    volatile struct _timer *t = TIMER[PTIMER];
+
+    disable_irq(PTIMER_IRQ);
+    t->STOP = 1;
+    t->INTENCLR = BIT(TIMER_INT_COMPARE0);
+    t->COMPARE[0] = 0;
+    clear_pending(PTIMER_IRQ);
+    running = 0;
+}
+
+/* profile_dump -- print samples in the form that profsym expects */
+void profile_dump(void)
+{
+    /* Pause sampling, so the counts stay still as we print them */
+    disable_irq(PTIMER_IRQ);
+
+    printf("profile %u samples at %d Hz\n", total, prof_hz);
+    for (int pid = 0; pid < NPIDS; pid++) {
+        if (pid_count[pid] > 0)
+            printf("pid %d %s %u\n", pid, proc_name(pid), pid_count[pid]);
+    }
+    printf("text %x %d\n", text_base, shift);
+    for (int b = 0; b < NBUCKETS; b++) {
+        if (hist[b] > 0)
+            printf("pc %x %u\n", text_base + (b << shift), hist[b]);
+    }
+    printf("other %u\n", outside);
+    printf("end\n");
+
+    if (running) enable_irq(PTIMER_IRQ);
+}
@@ -33,6 +33,9 @@ static volatile int group = 0;
 
 /* init_radio -- initialise radio hardware */
 static void init_radio() {
+    // The radio needs the crystal, which startup leaves off with RTC=1
+    timer_xtal(1);
+
     RADIO_TXPOWER = 0;          // Default transmit power
     RADIO_FREQUENCY = FREQ;     // Transmission frequency
     RADIO_MODE = RADIO_MODE_NRF_1Mbit; // 1Mbit/sec data rate
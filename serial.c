@@ -5,23 +5,34 @@
 #include "hardware.h"
 #include <stdarg.h>
 
-#ifdef UBIT
-#define TX USB_TX
-#define RX USB_RX
+/* On V1 there is one UART, connected to the USB interface chip, but
+V2 also has UARTE1, which we connect to pins on the edge connector for
+a data link (UART_EDGE).  Each UART has its own driver process,
+started by uart_init(), and its own buffers and clients, and the
+uart_... functions name the UART they use; the serial_... functions
+use the one connected to USB, and serial_init starts it with
+USB_TIMER as its character counter (see below). */
+
+#ifdef KL25Z
+#define N_UART 1
+#define UART_USB 0
 #endif
 
-static int SERIAL_TASK;
+static int UART_TASK[N_UART];
 
 /* Message types for serial task */
 #define PUTC 16
 #define GETC 17
 #define PUTBUF 18
+#define SETUP 19
 
 /* There are two buffers, one for characters waiting to be output, and
 another for input characters waiting to be read by other processes.
 The input buffer has |n_edit| characters in the current line, still
 subject to editing, and |n_avail| characters in previous lines that
-are available to other processes. */
+are available to other processes.  In raw mode (the SERIAL_RAW flag),
+there is no editing or echo, and each character is available as soon
+as it arrives; if the buffer is full, further input is lost. */
 
 /* NBUF -- size of input and output buffers.  Should be a power of 2. */
 #define NBUF 256
@@ -29,61 +40,303 @@ are available to other processes. */
 /* wrap -- reduce index to range [0..NBUF) */
 #define wrap(x) ((x) & (NBUF-1))
 
-/* Input buffer */
-static char rxbuf[NBUF];        /* Circular buffer for input */
-static int rx_inp = 0;          /* In pointer */
-static int rx_outp = 0;         /* Out pointer */
-static int n_avail = 0;         /* Number of chars avail for input */
-static int n_edit = 0;          /* Number of chars in current line */
+/* Clients waiting for the driver have their requests kept in a small
+pool of records that form two queues.  Readers are served one at a
+time in the order they arrived, so that each gets a contiguous piece
+of the input.  A reader waits either for one character (with
+serial_getc) or for a buffer to be filled (with serial_read); in the
+second case, the characters are copied straight into the reader's
+buffer as they become available, and a timer started by the driver
+ends the wait early.  The timer is used only if the program includes
+it.  Writers (including serial_putc) take turns: the one at the head
+of the queue has its output copied into txbuf as space appears there,
+until it has finished, or has written a line or QUANTUM characters
+while others are waiting; then it goes to the back of the queue.  The
+binary data from serial_write is not split at newlines, so a write of
+at most QUANTUM characters is never interleaved with others.  A
+client gets its reply when the last of its characters has been
+copied.  A request from serial_config waits in the writer queue until
+the output before it has gone, and while it waits there are no more
+turns.  The driver itself never waits for space in the buffer, so a
+long write cannot hold up readers or stop the driver from taking new
+requests. */
+
+#define MAX_REQ 8               /* Max number of clients waiting */
+#define QUANTUM 64              /* Max characters in a writer's turn */
+
+struct request {
+    int client;                 /* Process waiting for reply */
+    int type;                   /* GETC, READ, PUTC, PUTBUF, WRITE or SETUP */
+    char *buf;                  /* Client's buffer */
+    int n;                      /* Its size, or baud rate for SETUP */
+    int pos;                    /* Characters done so far */
+    int arg;                    /* Deadline for READ, or flags for SETUP */
+    int timer;                  /* Timer handle for READ timeout, or -1 */
+    char ch;                    /* The character for PUTC */
+    char cr;                    /* Whether \r for the \n at pos has gone */
+    char inplace;               /* Whether to send from buf (see below) */
+    int next;                   /* Next in queue or free list, or -1 */
+};
+
+typedef struct {
+    int head, tail;             /* First and last requests, or -1 */
+} queue;
+
+#ifdef UBIT_V2
+/* On V2, we use the UART with EasyDMA (UARTE), so that there is an
+interrupt and a message to the driver process for each block of
+characters rather than each character, at least when they come fast
+enough to matter.  The transmitter sends straight from the output
+buffer, as many characters at a time as lie contiguously there; they
+stay in the buffer until the ENDTX event says they have gone.  The
+receiver is never stopped: it fills the two halves of rxdma
+alternately, and when one is full, the shortcut from ENDRX to STARTRX
+restarts it at once on the other, whose address the driver loaded
+when the RXSTARTED event for the first came, so there is no gap for
+the receiver's small FIFO to cover.  To find how many characters have
+arrived, a spare timer in counter mode counts RXDRDY events through
+the PPI, and its compare event, set one beyond the characters already
+taken, interrupts the driver when there are more.  The driver then
+takes all that have been counted, so at high rates each interrupt
+deals with many characters.  (The count can run a moment ahead of the
+transfer into RAM, but the interrupt message takes much longer to
+reach the driver.)  Each UART needs its own PPI channel, and a timer
+given to uart_init() that nothing else uses: serial_init() gives
+Timer 4 to UART_USB, timer.c uses Timers 0 and 1 (except with RTC=1),
+the profiler Timer 2, and bench.c Timer 3.  uart_init() panics if
+given one of the timers that the drivers use.
+
+The kprintf() routine used by the process dump puts UART0 back
+into its legacy mode, so after a dump the driver sets up the UARTE
+again; debugging output from kprintf elsewhere will stop the driver
+from working. */
+
+#define RXCHUNK 64              /* Size of each DMA receive buffer */
+#define RXDMA (2*RXCHUNK)       /* Size of both: a power of 2 */
+
+static const int timer_irq[] = {
+    TIMER0_IRQ, TIMER1_IRQ, TIMER2_IRQ, TIMER3_IRQ, TIMER4_IRQ
+};
+
+/* Timers that uart_init() refuses: timer.c's unless RTC=1, and the
+   profiler's */
+#ifdef TIMER_RTC
+#define TIMERS_TAKEN BIT(2)
+#else
+#define TIMERS_TAKEN (BIT(0) | BIT(1) | BIT(2))
+#endif
+#endif
 
-/* Output buffer */
-static char txbuf[NBUF];        /* Circular buffer for output */
-static int tx_inp = 0;          /* In pointer */
-static int tx_outp = 0;         /* Out pointer */
-static int n_tx = 0;            /* Character count */
+#define USB_TIMER 4             /* Timer for UART_USB (V2 only) */
+
+/* port -- state of the driver for one UART */
+static struct port {
+    int id;                     /* Index in port table */
+
+    /* Input buffer */
+    char rxbuf[NBUF];           /* Circular buffer for input */
+    int rx_inp;                 /* In pointer */
+    int rx_outp;                /* Out pointer */
+    int n_avail;                /* Number of chars avail for input */
+    int n_edit;                 /* Number of chars in current line */
+
+    /* Output buffer */
+    char txbuf[NBUF];           /* Circular buffer for output */
+    int tx_inp;                 /* In pointer */
+    int tx_outp;                /* Out pointer */
+    int n_tx;                   /* Character count */
+    int txidle;                 /* True if transmitter is idle */
+
+    int baud;                   /* Current baud rate */
+    int flags;                  /* Current flags, e.g. SERIAL_PARITY */
+
+    /* Clients */
+    struct request req[MAX_REQ]; /* Pool of requests */
+    queue readers, writers;     /* Requests waiting */
+    int free_req;               /* Free list of request records */
+    int turn;                   /* Characters written in this turn */
+    int n_setup;                /* Number of SETUP requests waiting */
+    int wr_direct;              /* Whether direct writer has started */
+
+#ifdef UBIT_V2
+    volatile struct _uarte *dev; /* The UARTE */
+    int tno;                    /* Number of its character counter */
+    volatile struct _timer *timer; /* The counter itself */
+    char rxdma[RXDMA];          /* Double buffer for reception */
+    int rx_next;                /* Half to load on RXSTARTED */
+    unsigned rx_taken;          /* Count of characters taken */
+    int need_setup;             /* Whether kprintf has used the UART */
+    int tx_used;                /* Whether STARTTX since last stop */
+#endif
+} port[N_UART];
+
+/* uart_pins -- pins and other resources for each UART */
+static const struct {
+    unsigned tx, rx;            /* Pins */
+    int irq;                    /* Interrupt */
+    char *name;                 /* Name of driver process */
+#ifdef UBIT_V2
+    int ppi;                    /* PPI channel for counting */
+#endif
+} uart_pins[N_UART] = {
+#ifdef UBIT_V1
+    { USB_TX, USB_RX, UART_IRQ, "Serial" }
+#endif
+#ifdef UBIT_V2
+    { USB_TX, USB_RX, UART0_IRQ, "Serial", 0 },
+    { EDGE_TX, EDGE_RX, UART1_IRQ, "Serial1", 1 }
+#endif
+#ifdef KL25Z
+    { USB_TX, USB_RX, UART0_IRQ, "Serial" }
+#endif
+};
+
+int timer_once(int msec) __attribute((weak));
+int timer_cancel(int h) __attribute((weak));
+unsigned timer_now(void) __attribute((weak));
+
+/* new_req -- allocate a request and add it to a queue */
+static struct request *new_req(struct port *u, queue *q,
+                               int client, int type) {
+    int i = u->free_req;
+    struct request *r;
+
+    if (i < 0) panic("Too many serial clients");
+    r = &u->req[i];
+    u->free_req = r->next;
+    r->client = client;
+    r->type = type;
+    r->pos = 0;
+    r->timer = -1;
+    r->cr = r->inplace = 0;
+    r->next = -1;
+    if (q->head < 0)
+        q->head = i;
+    else
+        u->req[q->tail].next = i;
+    q->tail = i;
+    return r;
+}
 
-static int reader = -1;         /* Process waiting to read */
+/* finish -- reply to a client and remove its request from a queue */
+static void finish(struct port *u, queue *q, struct request *r, int val) {
+    int i = r - u->req, prev = -1;
 
-static int txidle = 1;          /* True if transmitter is idle */
+    send_int(r->client, REPLY, val);
+
+    for (int j = q->head; j != i; j = u->req[j].next) prev = j;
+    if (prev < 0)
+        q->head = r->next;
+    else
+        u->req[prev].next = r->next;
+    if (q->tail == i) q->tail = prev;
+
+    r->next = u->free_req;
+    u->free_req = i;
+}
+
+/* first -- first request in a queue, or NULL */
+static inline struct request *first(struct port *u, queue *q) {
+    return (q->head >= 0 ? &u->req[q->head] : NULL);
+}
+
+/* next_turn -- move the first writer to the back of the queue */
+static void next_turn(struct port *u) {
+    queue *q = &u->writers;
+    int i = q->head;
+
+    u->turn = 0;
+    if (u->req[i].next < 0 || u->n_setup > 0) return;
+    q->head = u->req[i].next;
+    u->req[q->tail].next = i;
+    u->req[i].next = -1;
+    q->tail = i;
+}
+
+/* A client that calls serial_write() with a buffer the transmitter
+can read is not copied into txbuf: when it reaches the head of the
+writer queue, the characters are sent straight from its buffer, by
+EasyDMA on V2 or a character at a time on V1, and it gets its reply
+when the last one has been taken.  Output already in txbuf goes
+first, but once the writer has started, it goes before any other
+output (such as echoed input), so that the write is not split up.
+The EasyDMA controller can read only RAM, so on V2 a buffer in flash
+is copied. */
+
+/* end_write -- reply to the direct writer when its buffer is consumed */
+static void end_write(struct port *u) {
+    finish(u, &u->writers, first(u, &u->writers), 0);
+    u->wr_direct = 0;
+    u->turn = 0;
+}
+
+#ifdef UBIT_V1
+#define direct(buf) 1
+#endif
+
+#ifdef UBIT_V2
+#define direct(buf) ((unsigned) (buf) >= 0x20000000)
+#define DMA_MAX 0xffff          /* Largest MAXCNT */
+#endif
+
+#ifdef KL25Z
+#define direct(buf) 0
+#endif
+
+/* put_char -- add character to output buffer, which must have space */
+static void put_char(struct port *u, char ch) {
+    u->txbuf[u->tx_inp] = ch;
+    u->tx_inp = wrap(u->tx_inp+1);
+    u->n_tx++;
+}
 
 /* echo -- echo input character */
-static void echo(char ch) {
-    if (n_tx == NBUF) return;
-    txbuf[tx_inp] = ch;
-    tx_inp = wrap(tx_inp+1);
-    n_tx++;
+static void echo(struct port *u, char ch) {
+    if (u->n_tx < NBUF) put_char(u, ch);
 }
 
 #define CTRL(x) ((x) & 0x1f)
 
 /* keypress -- deal with keyboard character by editing buffer */
-static void keypress(char ch) {
+static void keypress(struct port *u, char ch) {
+    if (u->flags & SERIAL_RAW) {
+        if (u->n_avail == NBUF) return;
+        u->rxbuf[u->rx_inp] = ch;
+        u->rx_inp = wrap(u->rx_inp+1);
+        u->n_avail++;
+        return;
+    }
+
     switch (ch) {
     case '\b':
     case 0177:
         /* Delete last character */
-        if (n_edit > 0) {
-            n_edit--;
-            rx_inp = wrap(rx_inp-1);
+        if (u->n_edit > 0) {
+            u->n_edit--;
+            u->rx_inp = wrap(u->rx_inp-1);
             /* This doesn't work well with TAB and other control chars */
-            echo('\b'); echo(' '); echo('\b');
+            echo(u, '\b'); echo(u, ' '); echo(u, '\b');
         }
         break;
 
     case '\r':
     case '\n':
         /* Make line available to clients */
-        if (n_avail + n_edit == NBUF) break;
-        rxbuf[rx_inp] = '\n';
-        rx_inp = wrap(rx_inp+1);
-        n_edit++;
-        n_avail += n_edit; n_edit = 0;
-        echo('\r'); echo('\n');
+        if (u->n_avail + u->n_edit == NBUF) break;
+        u->rxbuf[u->rx_inp] = '\n';
+        u->rx_inp = wrap(u->rx_inp+1);
+        u->n_edit++;
+        u->n_avail += u->n_edit; u->n_edit = 0;
+        echo(u, '\r'); echo(u, '\n');
         break;
-        
+
     case CTRL('B'):
-        /* Print process table dump */
+        /* Print process table dump on the console: it uses UART0 */
+        if (u->id != UART_USB) break;
         dump();
+#ifdef UBIT_V2
+        port[UART_USB].need_setup = 1;
+#endif
         break;
 
     default:
@@ -91,11 +344,11 @@ static void keypress(char ch) {
         if (ch < 040 || ch >= 0177) break;
 
         /* Add character to line */
-        if (n_avail + n_edit == NBUF) break;
-        rxbuf[rx_inp] = ch;
-        rx_inp = wrap(rx_inp+1);
-        n_edit++;
-        echo(ch);
+        if (u->n_avail + u->n_edit == NBUF) break;
+        u->rxbuf[u->rx_inp] = ch;
+        u->rx_inp = wrap(u->rx_inp+1);
+        u->n_edit++;
+        echo(u, ch);
     }
 }
 
@@ -105,17 +358,30 @@ the UART itself from sending interrupts.  The pending bit is cleared
 on return from the interrupt handler, but that doesn't stop the UART
 from setting it again. */
 
-#ifdef UBIT
+#ifdef UBIT_V1
+/* set_rate -- set baud rate and format */
+static void set_rate(struct port *u) {
+    UART_BAUDRATE = uart_baudrate(u->baud);
+    UART_CONFIG = FIELD(UART_CONFIG_PARITY,
+                        (u->flags & SERIAL_PARITY ?
+                         UART_PARITY_Even : UART_PARITY_None));
+}
+
+/* tx_stop -- wait until the last character has left the transmitter */
+static void tx_stop(struct port *u) {
+    /* TXDRDY comes when the character has been sent */
+}
+
 /* serial_interrupt -- handle serial interrupt */
-static void serial_interrupt(void) {
+static void serial_interrupt(struct port *u) {
     if (UART_RXDRDY) {
         char ch = UART_RXD;
-        keypress(ch);
+        keypress(u, ch);
         UART_RXDRDY = 0;
     }
 
     if (UART_TXDRDY) {
-        txidle = 1;
+        u->txidle = 1;
         UART_TXDRDY = 0;
     }
 
@@ -124,16 +390,150 @@ static void serial_interrupt(void) {
 }
 #endif
 
+#ifdef UBIT_V2
+/* set_rate -- set baud rate and format */
+static void set_rate(struct port *u) {
+    u->dev->BAUDRATE = uart_baudrate(u->baud);
+    u->dev->CONFIG = FIELD(UARTE_CONFIG_PARITY,
+                           (u->flags & SERIAL_PARITY ?
+                            UARTE_PARITY_Enabled : UARTE_PARITY_Disabled));
+}
+
+/* tx_stop -- wait until the last character has left the transmitter */
+static void tx_stop(struct port *u) {
+    if (! u->tx_used) return;
+    u->tx_used = 0;
+    u->dev->STOPTX = 1;
+    while (! u->dev->TXSTOPPED) { }
+    u->dev->TXSTOPPED = 0;
+}
+
+/* uarte_setup -- configure UARTE, character counter and PPI */
+static void uarte_setup(struct port *u) {
+    volatile struct _uarte *dev = u->dev;
+    volatile struct _timer *t = u->timer;
+    int ppi = uart_pins[u->id].ppi;
+
+    dev->ENABLE = UARTE_ENABLE_Disabled;
+    set_rate(u);
+    dev->PSELTXD = uart_pins[u->id].tx; // choose pins
+    dev->PSELRXD = uart_pins[u->id].rx;
+    dev->SHORTS = BIT(UARTE_ENDRX_STARTRX);
+    dev->ENDRX = 0;
+    dev->ENDTX = 0;
+    dev->RXSTARTED = 0;
+    dev->ENABLE = UARTE_ENABLE_Enabled;
+
+    /* The timer counts characters, and interrupts at the next one */
+    t->STOP = 1;
+    t->MODE = TIMER_MODE_Counter;
+    t->BITMODE = TIMER_BITMODE_32Bit;
+    t->CLEAR = 1;
+    t->SHORTS = 0;
+    t->CC[0] = 1;
+    t->COMPARE[0] = 0;
+    t->INTENSET = BIT(TIMER_INT_COMPARE0);
+    t->START = 1;
+
+    PPI_CH[ppi].EEP = &dev->RXDRDY;
+    PPI_CH[ppi].TEP = &t->COUNT;
+    PPI_CHENSET = BIT(ppi);
+
+    u->rx_taken = 0;
+    u->rx_next = 1;
+    dev->RXD.PTR = &u->rxdma[0];
+    dev->RXD.MAXCNT = RXCHUNK;
+    dev->STARTRX = 1;
+    u->tx_used = 0;
+
+    /* Any transmission in progress was lost, and will be repeated */
+    u->txidle = 1;
+    u->need_setup = 0;
+
+    dev->INTENSET = BIT(UARTE_INT_RXSTARTED) | BIT(UARTE_INT_ENDTX);
+}
+
+/* take_chars -- deal with all characters counted so far */
+static void take_chars(struct port *u) {
+    volatile struct _timer *t = u->timer;
+    unsigned count;
+
+    while (1) {
+        t->CAPTURE[1] = 1;
+        count = t->CC[1];
+        if (count == u->rx_taken) return;
+
+        /* If we fell more than a buffer behind, the oldest are lost */
+        if (count - u->rx_taken > RXDMA) u->rx_taken = count - RXDMA;
+
+        while (u->rx_taken != count) {
+            keypress(u, u->rxdma[u->rx_taken & (RXDMA-1)]);
+            u->rx_taken++;
+        }
+
+        /* Any character that arrives after this makes a compare
+           event; one that came before it is found by the loop */
+        t->CC[0] = count+1;
+    }
+}
+
+/* serial_interrupt -- handle serial interrupt */
+static void serial_interrupt(struct port *u) {
+    volatile struct _uarte *dev = u->dev;
+    volatile struct _timer *t = u->timer;
+    int irq = uart_pins[u->id].irq;
+    int tirq = timer_irq[u->tno];
+
+    if (dev->RXSTARTED) {
+        /* Load the other half for the restart after ENDRX */
+        dev->RXSTARTED = 0;
+        dev->RXD.PTR = &u->rxdma[u->rx_next * RXCHUNK];
+        u->rx_next = 1 - u->rx_next;
+    }
+
+    if (t->COMPARE[0]) {
+        t->COMPARE[0] = 0;
+        take_chars(u);
+    }
+
+    if (dev->ENDTX) {
+        int n = dev->TXD.AMOUNT;
+        if (u->wr_direct) {
+            struct request *w = first(u, &u->writers);
+            w->pos += n;
+            if (w->pos == w->n)
+                end_write(u);
+            else if (w->next >= 0) {
+                u->wr_direct = 0;
+                next_turn(u);
+            }
+        } else {
+            u->tx_outp = wrap(u->tx_outp+n);
+            u->n_tx -= n;
+        }
+        u->txidle = 1;
+        dev->ENDTX = 0;
+    }
+
+    if (u->need_setup) uarte_setup(u);
+
+    clear_pending(irq);
+    enable_irq(irq);
+    clear_pending(tirq);
+    enable_irq(tirq);
+}
+#endif
+
 #ifdef KL25Z
 /* serial_interrupt -- handle serial interrupt */
-static void serial_interrupt(void) {
+static void serial_interrupt(struct port *u) {
     if (UART0_S1 & BIT(UART_S1_RDRF)) {
         char ch = UART0_D;
-        keypress(ch);
+        keypress(u, ch);
     }
 
     if (UART0_S1 & BIT(UART_S1_TDRE)) {
-        txidle = 1;
+        u->txidle = 1;
         CLR_BIT(UART0_C2, UART_C2_TIE);
     }
 
@@ -142,77 +542,204 @@ static void serial_interrupt(void) {
 }
 #endif
 
-/* reply -- send reply or start transmitter if possible */
-static void reply(void) {
-    // Can we satisfy a reader?
-    if (reader >= 0 && n_avail > 0) {
-        send_int(reader, REPLY, rxbuf[rx_outp]);
-        rx_outp = wrap(rx_outp+1);
-        n_avail--;
-        reader = -1;
+/* take_input -- copy up to n available characters into buf */
+static int take_input(struct port *u, char *buf, int n) {
+    int k = 0;
+
+    while (u->n_avail > 0 && k < n) {
+        buf[k++] = u->rxbuf[u->rx_outp];
+        u->rx_outp = wrap(u->rx_outp+1);
+        u->n_avail--;
     }
 
-    // Can we start transmitting a character?
-    if (txidle && n_tx > 0) {
+    return k;
+}
+
+/* end_read -- reply to a reader with the count of characters read */
+static void end_read(struct port *u, struct request *r) {
+    if (r->timer >= 0) timer_cancel(r->timer);
+    finish(u, &u->readers, r, r->pos);
+}
+
+/* serve_readers -- satisfy readers in turn from the input buffer */
+static void serve_readers(struct port *u) {
+    struct request *r;
+
+    while ((r = first(u, &u->readers)) != NULL && u->n_avail > 0) {
+        if (r->buf == NULL) {
+            finish(u, &u->readers, r, u->rxbuf[u->rx_outp]);
+            u->rx_outp = wrap(u->rx_outp+1);
+            u->n_avail--;
+        } else {
+            r->pos += take_input(u, &r->buf[r->pos], r->n - r->pos);
+            if (r->pos < r->n) return;
+            end_read(u, r);
+        }
+    }
+}
+
+/* set_config -- change baud rate and flags */
+static void set_config(struct port *u, int baud, int flags) {
+    u->baud = baud;
+    u->flags = flags;
+    if (flags & SERIAL_RAW) {
+        /* Any partial line becomes available */
+        u->n_avail += u->n_edit;
+        u->n_edit = 0;
+    }
 #ifdef UBIT
-        UART_TXD = txbuf[tx_outp];
+    tx_stop(u);
+    set_rate(u);
+    if (u->id == UART_USB) kprintf_config(baud, flags);
 #endif
-#ifdef KL25Z
-        UART0_D = txbuf[tx_outp];
-        SET_BIT(UART0_C2, UART_C2_TIE);
-#endif
-        tx_outp = wrap(tx_outp+1);
-        n_tx--;
-        txidle = 0;
+}
+
+/* serve_writers -- copy output from writers in turn into txbuf */
+static void serve_writers(struct port *u) {
+    struct request *w;
+
+    while ((w = first(u, &u->writers)) != NULL) {
+        if (w->type == SETUP) {
+            /* Let output already queued go at the old rate */
+            if (u->n_tx > 0 || ! u->txidle) return;
+            set_config(u, w->n, w->arg);
+            u->n_setup--;
+        } else {
+            if (w->inplace) return;
+
+            while (w->pos < w->n) {
+                char ch = w->buf[w->pos];
+                if (u->n_tx == NBUF) return;
+                if (w->type != WRITE && ch == '\n' && ! w->cr) {
+                    /* Translate \n to \r\n except for WRITE */
+                    put_char(u, '\r');
+                    w->cr = 1;
+                    continue;
+                }
+                put_char(u, ch);
+                w->cr = 0;
+                w->pos++;
+                if (((ch == '\n' && w->type != WRITE)
+                     || ++u->turn >= QUANTUM) && w->pos < w->n) {
+                    next_turn(u);
+                    break;
+                }
+            }
+
+            if (w->pos < w->n) continue;
+        }
+
+        finish(u, &u->writers, w, 0);
+        u->turn = 0;
     }
 }
 
-/* queue_char -- add character to output buffer */
-static void queue_char(char ch) {
-    while (n_tx == NBUF) {
-        // The buffer is full -- wait for a space to appear
-        receive(INTERRUPT, NULL);
-        serial_interrupt();
-        reply();
+/* reply -- send replies or start transmitter if possible */
+static void reply(struct port *u) {
+    struct request *w;
+
+    serve_writers(u);
+    serve_readers(u);
+
+    // Can we send from the writer's buffer?
+    w = first(u, &u->writers);
+    if (u->txidle && w != NULL && w->inplace
+        && (u->wr_direct || u->n_tx == 0)) {
+        u->wr_direct = 1;
+#ifdef UBIT_V1
+        UART_TXD = (byte) w->buf[w->pos++];
+        if (w->pos == w->n)
+            end_write(u);
+        else if (++u->turn >= QUANTUM) {
+            u->wr_direct = 0;
+            next_turn(u);
+        }
+#endif
+#ifdef UBIT_V2
+        /* Send it all in one go, unless others are waiting */
+        int n = w->n - w->pos;
+        if (w->next >= 0 && n > QUANTUM) n = QUANTUM;
+        if (n > DMA_MAX) n = DMA_MAX;
+        u->dev->TXD.PTR = &w->buf[w->pos];
+        u->dev->TXD.MAXCNT = n;
+        u->dev->STARTTX = 1;
+        u->tx_used = 1;
+#endif
+        u->txidle = 0;
     }
 
-    txbuf[tx_inp] = ch;
-    tx_inp = wrap(tx_inp+1);
-    n_tx++;
+    // Can we start transmitting a character?
+    if (u->txidle && u->n_tx > 0) {
+#ifdef UBIT_V1
+        UART_TXD = (byte) u->txbuf[u->tx_outp];
+#endif
+#ifdef KL25Z
+        UART0_D = u->txbuf[u->tx_outp];
+        SET_BIT(UART0_C2, UART_C2_TIE);
+#endif
+#ifdef UBIT_V2
+        /* Send as many characters as lie contiguously in the buffer;
+           they are removed when the transfer ends */
+        int n = (u->tx_outp + u->n_tx <= NBUF ?
+                 u->n_tx : NBUF - u->tx_outp);
+        u->dev->TXD.PTR = &u->txbuf[u->tx_outp];
+        u->dev->TXD.MAXCNT = n;
+        u->dev->STARTTX = 1;
+        u->tx_used = 1;
+#else
+        u->tx_outp = wrap(u->tx_outp+1);
+        u->n_tx--;
+#endif
+        u->txidle = 0;
+    }
 }
 
-/* serial_task -- driver process for UART */
-static void serial_task(int arg) {
+/* serial_task -- driver process for a UART */
+static void serial_task(int id) {
+    struct port *u = &port[id];
+    int irq = uart_pins[id].irq;
     message m;
+    struct request *r;
     int client, n;
-    char ch;
     char *buf;
 
-#ifdef UBIT
+    u->id = id;
+    u->baud = SERIAL_BAUD;
+    u->flags = 0;
+
+#ifdef UBIT_V1
     UART_ENABLE = UART_ENABLE_Disabled;
-    UART_BAUDRATE = UART_BAUDRATE_9600; // 9600 baud
-    UART_CONFIG = FIELD(UART_CONFIG_PARITY, UART_PARITY_None);
-                                        // format 8N1
-    UART_PSELTXD = TX;                  // choose pins
-    UART_PSELRXD = RX;
+    set_rate(u);
+    UART_PSELTXD = uart_pins[id].tx;    // choose pins
+    UART_PSELRXD = uart_pins[id].rx;
     UART_ENABLE = UART_ENABLE_Enabled;
     UART_STARTTX = 1;
     UART_STARTRX = 1;
     UART_RXDRDY = 0;
 
     UART_INTENSET = BIT(UART_INT_RXDRDY) | BIT(UART_INT_TXDRDY);
-    connect(UART_IRQ);
-    enable_irq(UART_IRQ);
+    connect(irq);
+    enable_irq(irq);
+#endif
+
+#ifdef UBIT_V2
+    u->dev = UARTE[id];
+    u->timer = TIMER[u->tno];
+    uarte_setup(u);
+    connect(irq);
+    enable_irq(irq);
+    connect(timer_irq[u->tno]);
+    enable_irq(timer_irq[u->tno]);
 #endif
 
 #ifdef KL25Z
     // enable PLL clock
     SET_FIELD(SIM_SOPT2, SIM_SOPT2_UART0SRC, SIM_SOPT2_SRC_PLL);
     SET_BIT(SIM_SCGC4, SIM_SCGC4_UART0);
-    
+
     // Disable UART before changing registers
     UART0_C2 &= ~(BIT(UART_C2_RE) | BIT(UART_C2_TE));
-    
+
     // set baud rate
     unsigned BR = UART_BAUD_9600;
     SET_FIELD(UART0_BDH, UART_BDH_SBR, BR >> 8);
@@ -233,12 +760,19 @@ static void serial_task(int arg) {
     UART0_C2 |= BIT(UART_C2_RE) | BIT(UART_C2_TE);
 
     SET_BIT(UART0_C2, UART_C2_RIE);
-    enable_irq(UART0_IRQ);
-    connect(UART0_IRQ);
-    enable_irq(UART0_IRQ);
+    enable_irq(irq);
+    connect(irq);
+    enable_irq(irq);
 #endif
 
-    txidle = 1;
+    u->txidle = 1;
+
+    u->readers.head = u->writers.head = -1;
+    u->free_req = -1;
+    for (int i = 0; i < MAX_REQ; i++) {
+        u->req[i].next = u->free_req;
+        u->free_req = i;
+    }
 
     while (1) {
         receive(ANY, &m);
@@ -246,67 +780,197 @@ static void serial_task(int arg) {
 
         switch (m.type) {
         case INTERRUPT:
-            serial_interrupt();
+            serial_interrupt(u);
             break;
 
         case GETC:
-            if (reader >= 0)
-                panic("Two clients cannot wait for input at once");
-            reader = client;
-            break;
-            
-        case PUTC:
-            ch = m.int1;
-            if (ch == '\n') queue_char('\r');
-            queue_char(ch);
+            r = new_req(u, &u->readers, client, GETC);
+            r->buf = NULL;
             break;
 
-        case PUTBUF:
+        case READ:
             buf = m.ptr1;
             n = m.int2;
-            for (int i = 0; i < n; i++) {
-                char ch = buf[i];
-                if (ch == '\n') queue_char('\r');
-                queue_char(ch);
+            if (m.int3 == 0 || n == 0) {
+                /* Take what there is and reply at once, unless
+                   other readers are waiting for it */
+                send_int(client, REPLY,
+                         (u->readers.head < 0 ? take_input(u, buf, n) : 0));
+                break;
+            }
+            r = new_req(u, &u->readers, client, READ);
+            r->buf = buf;
+            r->n = n;
+            if (m.int3 > 0 && timer_once) {
+                r->arg = timer_now() + m.int3;
+                r->timer = timer_once(m.int3);
             }
-            send_msg(client, REPLY);
+            break;
+
+        case PING:
+            /* The timeout for a read: end any that are due */
+            for (int i = u->readers.head, next; i >= 0; i = next) {
+                r = &u->req[i];
+                next = r->next;
+                if (r->timer >= 0 && (int) (m.int1 - r->arg) >= 0) {
+                    r->timer = -1;
+                    finish(u, &u->readers, r, r->pos);
+                }
+            }
+            break;
+
+        case PUTC:
+            r = new_req(u, &u->writers, client, PUTC);
+            r->ch = m.int1;
+            r->buf = &r->ch;
+            r->n = 1;
+            break;
+
+        case PUTBUF:
+            r = new_req(u, &u->writers, client, PUTBUF);
+            r->buf = m.ptr1;
+            r->n = m.int2;
+            break;
+
+        case WRITE:
+            r = new_req(u, &u->writers, client, WRITE);
+            r->buf = m.ptr1;
+            r->n = m.int2;
+            /* Reply when the buffer has been consumed */
+            r->inplace = (r->n > 0 && direct(r->buf));
+            break;
+
+        case SETUP:
+            r = new_req(u, &u->writers, client, SETUP);
+            u->n_setup++;
+            r->n = m.int1;
+            r->arg = m.int2;
             break;
 
         default:
             badmesg(m.type);
         }
-          
-        reply();
+
+        reply(u);
     }
 }
 
-/* serial_init -- start the serial driver task */
-void serial_init(void) {
-    SERIAL_TASK = start("Serial", serial_task, 0, 256);
+/* uart_init -- start the driver task for a UART, using a spare timer
+   to count characters on V2 */
+void uart_init(int id, int timer) {
+    if (UART_TASK[id] != 0) return;
+#ifdef UBIT_V2
+    if (timer < 0 || timer > 4 || (TIMERS_TAKEN & BIT(timer)))
+        panic("Timer %d cannot be used by a UART", timer);
+    for (int i = 0; i < N_UART; i++) {
+        if (UART_TASK[i] != 0 && port[i].tno == timer)
+            panic("Timer %d is already used by UART %d", timer, i);
+    }
+    port[id].tno = timer;
+#endif
+    UART_TASK[id] = start(uart_pins[id].name, serial_task, id, 256);
 }
 
-/* serial_putc -- queue a character for output */
-void serial_putc(char ch) {
-    send_int(SERIAL_TASK, PUTC, ch);
+/* uart_config -- set baud rate and flags, after sending any output
+   that is waiting */
+void uart_config(int id, int baud, int flags) {
+    message m;
+
+    if (uart_baudrate(baud) == 0)
+        panic("Unsupported baud rate %d", baud);
+
+    m.type = SETUP;
+    m.int1 = baud;
+    m.int2 = flags;
+    sendrec(UART_TASK[id], &m);
 }
 
-/* serial_getc -- request an input character */
-char serial_getc(void) {
+/* uart_read -- read n bytes into buf, waiting at most timeout msec
+   if timeout > 0, not at all if timeout = 0, or for ever if timeout <
+   0; return the number read */
+int uart_read(int id, char *buf, int n, int timeout) {
     message m;
-    m.type = GETC;
-    sendrec(SERIAL_TASK, &m);
+    m.type = READ;
+    m.ptr1 = buf;
+    m.int2 = n;
+    m.int3 = timeout;
+    sendrec(UART_TASK[id], &m);
     return m.int1;
 }
 
-/* print_buf -- output routine for use by printf */
-void print_buf(char *buf, int n) {
+/* uart_write -- write n bytes from buf without translation */
+void uart_write(int id, const char *buf, int n) {
+    message m;
+    m.type = WRITE;
+    m.ptr1 = (char *) buf;
+    m.int2 = n;
+    sendrec(UART_TASK[id], &m);
+}
+
+/* uart_print -- write n bytes from buf with \n translated to \r\n */
+void uart_print(int id, const char *buf, int n) {
     /* Using sendrec() here avoids a potential priority inversion:
        with separate send() and receive() calls, a lower-priority
        client process can block a reply from the device driver. */
 
     message m;
     m.type = PUTBUF;
-    m.ptr1 = buf;
+    m.ptr1 = (char *) buf;
     m.int2 = n;
-    sendrec(SERIAL_TASK, &m);
+    sendrec(UART_TASK[id], &m);
+}
+
+/* uart_putc -- queue a character for output */
+void uart_putc(int id, char ch) {
+    /* The reply comes when the character is in the buffer, so a
+       client cannot flood the driver with requests */
+    message m;
+    m.type = PUTC;
+    m.int1 = ch;
+    sendrec(UART_TASK[id], &m);
+}
+
+/* uart_getc -- request an input character */
+char uart_getc(int id) {
+    message m;
+    m.type = GETC;
+    sendrec(UART_TASK[id], &m);
+    return m.int1;
+}
+
+/* The serial_... functions use the UART that is connected to USB */
+
+/* serial_init -- start the serial driver task */
+void serial_init(void) {
+    uart_init(UART_USB, USB_TIMER);
+}
+
+/* serial_config -- set baud rate and flags */
+void serial_config(int baud, int flags) {
+    uart_config(UART_USB, baud, flags);
+}
+
+/* serial_read -- read up to n bytes with a timeout */
+int serial_read(char *buf, int n, int timeout) {
+    return uart_read(UART_USB, buf, n, timeout);
+}
+
+/* serial_write -- write n bytes from buf without translation */
+void serial_write(const char *buf, int n) {
+    uart_write(UART_USB, buf, n);
+}
+
+/* serial_putc -- queue a character for output */
+void serial_putc(char ch) {
+    uart_putc(UART_USB, ch);
+}
+
+/* serial_getc -- request an input character */
+char serial_getc(void) {
+    return uart_getc(UART_USB);
+}
+
+/* print_buf -- output routine for use by printf */
+void print_buf(char *buf, int n) {
+    uart_print(UART_USB, buf, n);
 }
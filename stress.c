@@ -0,0 +1,328 @@
+/* stress.c */
+/* Copyright (c) 2026 J. M. Spivey */
+
+/* Randomised stress test for the kernel.  A crowd of worker processes
+with random priorities make random calls of send, receive, sendrec
+and receive_t to each other, while a noise process sends stray REPLY
+messages and triggers software interrupts.  Build it with
+
+    make CHECK=1 stress.hex     (after 'make clean')
+
+so that the kernel checks its queues and process states after every
+system call, and panics if they are inconsistent.  The contents of
+each message are checked on arrival.  Once a second, the monitor
+prints the number of operations performed, which also makes the test a
+crude benchmark; without CHECK=1, the numbers measure the speed of the
+kernel.  The host port (config.host) runs the same program under
+Linux, where interrupts come at less predictable times.
+
+Deadlock is avoided by a simple rule: a worker sends and calls only
+workers with higher numbers, so the only waits for lower-numbered
+processes are for replies, and those are sent at once.  The noise
+process receives nothing, so nobody waits for it.
+
+A timer process also keeps modifying and cancelling pulse timers while
+their PINGs are owed, because it is busy and not receiving: the timer
+service must forget the owed PINGs without losing track of the
+timers. */
+
+#include "microbian.h"
+#include "hardware.h"
+#include "lib.h"
+
+#ifndef SEED
+#define SEED 12345
+#endif
+
+#define NWORKERS 20             /* Number of worker processes */
+#define WSTACK 256              /* Stack size for workers */
+
+/* Message types */
+#define DATA 16                 /* Sent with send() */
+#define CALL 17                 /* Sent with sendrec() */
+
+#define MAGIC 0x5a5a5a5a        /* Checksum constant */
+
+/* Operations counted by the workers */
+#define OP_SEND 0
+#define OP_CALL 1
+#define OP_RECEIVE 2
+#define OP_TIMEOUT 3
+#define OP_NOISE 4
+#define OP_YIELD 5
+#define NOPS 6
+
+static const char *op_name[NOPS] = {
+    "send", "sendrec", "receive", "timeout", "noise", "yield"
+};
+
+static int WORKER[NWORKERS];
+static int NOISE, IRQ;
+
+/* Each worker counts its own operations, so no locking is needed */
+static volatile unsigned count[NWORKERS][NOPS];
+static volatile unsigned n_irq, n_noise, n_timer;
+
+/* rand32 -- xorshift generator, one state per process */
+static unsigned rand32(unsigned *state)
+{
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return (*state = x);
+}
+
+/* choose -- random integer in [0..n) */
+static int choose(unsigned *state, int n)
+{
+    return rand32(state) % n;
+}
+
+/* check -- panic if a message is corrupt */
+static void check(int ok, message *m)
+{
+    if (! ok)
+        panic("Bad message type %d from %d", m->type, m->sender);
+}
+
+
+/* WORKERS */
+
+/* handle -- deal with a message received by worker w */
+static void handle(int w, message *m)
+{
+    message r;
+
+    switch (m->type) {
+    case DATA:
+        check(m->int1 == m->sender && m->int3 == (m->int2 ^ MAGIC), m);
+        count[w][OP_RECEIVE]++;
+        break;
+
+    case CALL:
+        check(m->int1 == m->sender && m->int3 == (m->int2 ^ MAGIC), m);
+        r.type = REPLY;
+        r.int1 = m->int2 + 1;
+        send(m->sender, &r);
+        count[w][OP_RECEIVE]++;
+        break;
+
+    case REPLY:
+        check(m->sender == NOISE, m);
+        count[w][OP_NOISE]++;
+        break;
+
+    case TIMEOUT:
+        count[w][OP_TIMEOUT]++;
+        break;
+
+    default:
+        badmesg(m->type);
+    }
+}
+
+/* call -- sendrec to worker t and wait for the genuine reply */
+static void call(int w, int t, unsigned *seed)
+{
+    message m;
+    int nonce = rand32(seed);
+
+    m.type = CALL;
+    m.int1 = WORKER[w];
+    m.int2 = nonce;
+    m.int3 = nonce ^ MAGIC;
+    sendrec(WORKER[t], &m);
+
+    /* The reply may be a stray one from the noise process */
+    while (m.sender != WORKER[t]) {
+        check(m.type == REPLY && m.sender == NOISE, &m);
+        count[w][OP_NOISE]++;
+        receive(REPLY, &m);
+    }
+
+    check(m.type == REPLY && m.int1 == nonce + 1, &m);
+    count[w][OP_CALL]++;
+}
+
+static const int filter[] = { ANY, ANY, DATA, CALL, REPLY };
+#define NFILTER (sizeof(filter) / sizeof(filter[0]))
+
+/* worker -- make random system calls */
+static void worker(int w)
+{
+    unsigned seed = SEED + 7919 * (w+1);
+    message m;
+    int t;
+
+    while (1) {
+        int r = choose(&seed, 100);
+
+        if (w < NWORKERS-1 && r < 30) {
+            /* Send to a higher-numbered worker */
+            t = w + 1 + choose(&seed, NWORKERS-w-1);
+            m.type = DATA;
+            m.int1 = WORKER[w];
+            m.int2 = rand32(&seed);
+            m.int3 = m.int2 ^ MAGIC;
+            send(WORKER[t], &m);
+            count[w][OP_SEND]++;
+        } else if (w < NWORKERS-1 && r < 45) {
+            /* Call a higher-numbered worker */
+            t = w + 1 + choose(&seed, NWORKERS-w-1);
+            call(w, t, &seed);
+        } else if (r < 85) {
+            /* Receive with a random filter and timeout, usually zero */
+            int t = (choose(&seed, 16) == 0 ? choose(&seed, 20) : 0);
+            receive_t(filter[choose(&seed, NFILTER)], &m, t);
+            handle(w, &m);
+        } else if (r < 90) {
+            /* Wait for anything */
+            receive(ANY, &m);
+            handle(w, &m);
+        } else if (r < 98) {
+            yield();
+            count[w][OP_YIELD]++;
+        } else {
+            /* Change priority; P_HANDLER only rarely */
+            int p = choose(&seed, 8);
+            priority(p == 0 ? P_HANDLER : p < 4 ? P_HIGH : P_LOW);
+        }
+    }
+}
+
+
+/* NOISE AND INTERRUPTS */
+
+/* noise -- send stray replies and trigger interrupts */
+static void noise(int arg)
+{
+    unsigned seed = SEED;
+    message m;
+
+    while (1) {
+        switch (choose(&seed, 4)) {
+        case 0:
+        case 1:
+            m.type = REPLY;
+            m.int1 = rand32(&seed);
+            send(WORKER[choose(&seed, NWORKERS)], &m);
+            n_noise++;
+            break;
+
+        case 2:
+            NVIC_ISPR[0] = BIT(SWI0_IRQ);
+            break;
+
+        default:
+            timer_delay(choose(&seed, 3));
+        }
+    }
+}
+
+/* irq_task -- handler for the software interrupt */
+static void irq_task(int arg)
+{
+    connect(SWI0_IRQ);
+    enable_irq(SWI0_IRQ);
+
+    while (1) {
+        receive(INTERRUPT, NULL);
+        n_irq++;
+        enable_irq(SWI0_IRQ);
+    }
+}
+
+
+/* TIMERS */
+
+#define PULSE 5                 /* Period of pulse timer (ms) */
+
+/* busy -- run without receiving for msec milliseconds */
+static void busy(int msec)
+{
+    unsigned start = timer_now();
+    while (timer_now() - start < msec) { }
+}
+
+/* timers -- modify and cancel timers that owe a PING */
+static void timers(int arg)
+{
+    unsigned seed = SEED;
+    int h;
+
+    while (1) {
+        /* Let the timer expire more than once while we are busy, so
+           a PING is owed, then restart it and let it expire again */
+        h = timer_pulse(PULSE);
+        busy(2*PULSE + 2);
+        timer_modify(h, PULSE, PULSE);
+        busy(2*PULSE + 2);
+
+        receive(PING, NULL);
+
+        if (choose(&seed, 2) == 0) {
+            /* Cancel it while another PING is owed */
+            busy(2*PULSE + 2);
+        }
+        timer_cancel(h);
+        n_timer++;
+
+        timer_delay(choose(&seed, 50));
+    }
+}
+
+
+/* MONITOR */
+
+/* monitor -- report progress once a second */
+static void monitor(int arg)
+{
+    unsigned total[NOPS], prev = 0, sum;
+    int secs = 0;
+
+    printf("\nmicro:bian stress test, %d workers, seed %d\n",
+           NWORKERS, SEED);
+#ifdef MICROBIAN_CHECK
+    printf("kernel checks enabled\n");
+#endif
+
+    timer_pulse(1000);
+
+    while (1) {
+        receive(PING, NULL);
+        secs++;
+
+        sum = 0;
+        for (int k = 0; k < NOPS; k++) {
+            total[k] = 0;
+            for (int w = 0; w < NWORKERS; w++)
+                total[k] += count[w][k];
+            sum += total[k];
+        }
+
+        printf("%d: %u ops/s", secs, sum - prev);
+        for (int k = 0; k < NOPS; k++)
+            printf(" %s=%u", op_name[k], total[k]);
+        printf(" irq=%u timers=%u\n", n_irq, n_timer);
+
+        if (sum == prev) {
+            printf("No progress!\n");
+            dump();
+        }
+        prev = sum;
+    }
+}
+
+void init(void)
+{
+    serial_init();
+    timer_init();
+
+    start("Monitor", monitor, 0, STACK);
+    for (int w = 0; w < NWORKERS; w++)
+        WORKER[w] = start("Worker", worker, w, WSTACK);
+    NOISE = start("Noise", noise, 0, WSTACK);
+    IRQ = start("Irq", irq_task, 0, WSTACK);
+    start("Timers", timers, 0, WSTACK);
+}
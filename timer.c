@@ -3,8 +3,7 @@
 
 #include "microbian.h"
 #include "hardware.h"
-
-static int TIMER_TASK;
+#include <string.h>
 
 #ifdef UBIT_V1
 #define TICK 5                  // Interval between updates (ms)
@@ -14,50 +13,335 @@ static int TIMER_TASK;
 #define TICK 1                  // Helps with faster display update
 #endif
 
-#define MAX_TIMERS 8
+/* Normally, the tick comes from Timer 1 and the microsecond count from
+Timer 0, and both run from the 16MHz high-frequency clock, so that
+clock and its crystal must run all the time.  With 'make RTC=1', both
+come instead from RTC1, which counts the 32.768kHz low-frequency clock
+and uses far less power.  The startup code then leaves the crystal
+off, and the high-frequency clock runs only when the CPU or some
+peripheral needs it, so the board can sleep between events with only
+the RTC running.  The price is that the microsecond count has a
+resolution of one RTC tick, about 30.5 usec, and the low-frequency
+clock comes from an RC oscillator.  Left to itself, that is accurate
+only to 2% on V1 and 5% on V2, minutes in an hour, so we calibrate it
+against the crystal every few seconds, which brings it within 250
+parts per million on V1 and 500 on V2, a second or two in an hour.
+Also, the UART then takes its baud rate from the internal
+high-frequency oscillator, which is accurate to a percent or two:
+good enough at the usual rates, but a program that uses the fastest
+rates should keep the crystal running with timer_xtal(1), as radio.c
+does.  See the section on the RTC below. */
+
+
+/* Timers live in a pool of MAX_TIMERS records, and those that are
+pending are kept in a binary heap ordered by deadline, so each tick
+costs time only for the timers that expire, and creating, cancelling
+or changing a timer takes O(log n) steps.  Each record remembers its
+place in the heap so it can be removed quickly. */
+
+#ifdef UBIT_V1
+#define MAX_TIMERS 64
+#endif
+
+#ifdef UBIT_V2
+#define MAX_TIMERS 256
+#endif
+
+/* A handle combines the index of a record with its generation number,
+which changes each time the record is reused, so that a stale handle
+for a one-shot timer that has fired is harmless. */
+#define SLOT_BITS 10
+#define handle(i) ((timer[i].gen << SLOT_BITS) | (i))
 
-/* Millis will overflow in about 46 days, but that's long enough. */
+/* Millis wraps around after about 49 days, so times are compared by
+the sign of their difference, which is right for delays of up to 24
+days.  For longer times, use the 64-bit clock timer_clock(). */
 
-/* millis -- milliseconds since boot */
+/* millis -- milliseconds since boot, modulo 2^32 */
 static unsigned millis = 0;
 
-/* timer -- array of data for pending timer messages */
+/* before -- test if time a comes before time b */
+#define before(a, b) ((int) ((a) - (b)) < 0)
+
+static void clock_update(void);
+
+/* timer -- array of data for timer messages */
 static struct {
-    int client;      /* Process that receives message, or -1 if empty */
+    short client;    /* Process that receives message, or -1 if free */
+    short pos;       /* Place in heap, -1 if not there, or free list link */
+    unsigned short gen;   /* Generation number for handles */
+    unsigned short owed;  /* Expiries not yet delivered */
+    short link;      /* Next in owed list, or UNLISTED */
     unsigned period; /* Interval between messages, or 0 for one-shot */
+    unsigned slack;  /* Lateness allowed for coalescing with others */
     unsigned next;   /* Next time to send a message */
+    unsigned due;    /* Time of latest undelivered expiry */
 } timer[MAX_TIMERS];
 
-/* check_timers is called by the timer task and sends messages
-   directly to clients.  We assume that each client is waiting to
-   receive a PING message: otherwise the progress of the entire system
-   will be held up, possibly leading to deadlock. */
+#define UNLISTED -2
 
-/* check_timers -- send any messages that are due */
-static void check_timers(void)
+/* deadline -- latest time that timer i may expire */
+#define deadline(i) (timer[i].next + timer[i].slack)
+
+static short heap[MAX_TIMERS];  /* Pending timers, earliest first */
+static int n_heap = 0;          /* Number of pending timers */
+static int free_list = -1;      /* Chain of free records through pos */
+static int owed_list = -1;      /* Timers with expiries to deliver */
+
+/* There is no timer process: the heap is looked after by the
+interrupt handler for the tick, and clients change it directly with
+interrupts disabled rather than by sending a message.  On each tick,
+the handler passes the time to the kernel for the timeouts of
+receive_t(), then deals with any timers that are due, all without a
+context switch unless some process is woken that should preempt the
+current one. */
+
+/* heap_set -- put timer i at place k in the heap */
+static inline void heap_set(int k, int i)
+{
+    heap[k] = i;
+    timer[i].pos = k;
+}
+
+/* sift_up -- restore heap order by moving heap[k] towards the root */
+static void sift_up(int k)
+{
+    int i = heap[k];
+
+    while (k > 0) {
+        int parent = (k-1) >> 1;
+        if (! before(deadline(i), deadline(heap[parent]))) break;
+        heap_set(k, heap[parent]);
+        k = parent;
+    }
+
+    heap_set(k, i);
+}
+
+/* sift_down -- restore heap order by moving heap[k] away from the root */
+static void sift_down(int k)
+{
+    int i = heap[k];
+
+    while (1) {
+        int c = 2*k+1;
+        if (c >= n_heap) break;
+        if (c+1 < n_heap
+            && before(deadline(heap[c+1]), deadline(heap[c])))
+            c++;
+        if (! before(deadline(heap[c]), deadline(i))) break;
+        heap_set(k, heap[c]);
+        k = c;
+    }
+
+    heap_set(k, i);
+}
+
+/* heap_insert -- add timer i to the heap */
+static void heap_insert(int i)
 {
-    for (int i = 0; i < MAX_TIMERS; i++) {
-        if (timer[i].client >= 0 && millis >= timer[i].next) {
-            send_int(timer[i].client, PING, timer[i].next);
+    heap_set(n_heap, i);
+    sift_up(n_heap++);
+}
+
+/* heap_delete -- remove timer i from the heap */
+static void heap_delete(int i)
+{
+    int k = timer[i].pos, j;
 
-            if (timer[i].period > 0)
-                timer[i].next += timer[i].period;
-            else
-                timer[i].client = -1;
+    timer[i].pos = -1;
+    if (k == --n_heap) return;
 
+    /* Fill the hole with the last timer, then move it up or down */
+    j = heap[n_heap];
+    heap_set(k, j);
+    sift_up(k);
+    sift_down(timer[j].pos);
+}
+
+/* release -- return timer i to the free list */
+static void release(int i)
+{
+    timer[i].client = -1;
+    timer[i].gen++;
+    timer[i].owed = 0;
+
+    /* Only the tick handler takes records off the owed list, so one
+       that is listed is freed when it is taken off */
+    if (timer[i].link == UNLISTED) {
+        timer[i].pos = free_list;
+        free_list = i;
+    }
+}
+
+/* find -- index of timer for a handle, or -1 if stale */
+static int find(int h)
+{
+    int i = h & ((1 << SLOT_BITS) - 1);
+
+    if (h < 0 || i >= MAX_TIMERS || timer[i].client < 0
+        || handle(i) != h)
+        return -1;
+
+    return i;
+}
+
+/* When a timer expires, the handler sends its client a PING (from
+HARDWARE) with post(), which delivers it only if the client is
+waiting to receive one; otherwise, the expiry is owed, and the handler
+tries again on each later tick.  Further expiries of a periodic timer
+while a PING is owed are counted, and the PING that is finally
+delivered carries the time of the latest expiry as int1 and the number
+of expiries missed as int2, so a client that has fallen behind can
+tell and catch up.  (A timer with a period shorter than TICK expires
+more than once on some ticks, and all but one of those expiries count
+as missed.)  So a slow client cannot hold up other timers or the
+kernel's timeouts.  A one-shot timer that has expired keeps its record
+until the PING is delivered, so that it can still be cancelled.
+Clients may cancel or modify timers on the owed list, but only the
+handler adds timers to the list or takes them off. */
+
+/* A timer may be given some slack with timer_slack(), and then it
+expires at any time from when it is due until its deadline, the due
+time plus the slack.  Usually, it waits until the deadline, but if
+some other timer reaches its deadline first, then all timers that are
+due by then expire together, so that clients are woken at fewer
+distinct times and the CPU can sleep for longer between them.  The
+heap is ordered by deadline, so finding the timers that can join a
+wakeup means a scan of the heap; that happens only on ticks when some
+timer expires, and only if any timer has ever had slack.  A periodic
+timer keeps its phase: each period is counted from the due time, not
+from the time of the last expiry, and the slack should be less than
+the period.
+
+To count the wakeups saved, each expiry notes the tick on which it
+would have happened without slack.  All timers that are due expire on
+every wakeup, so those ticks had no wakeup of their own, and without
+slack, each distinct one would have needed one.  The number saved is
+the number of such ticks less the number of actual wakeups. */
+
+static unsigned max_slack = 0;  /* Largest slack yet set */
+static unsigned n_wakeups = 0;  /* Ticks on which any timer expired */
+static unsigned n_nominal = 0;  /* Ticks on which they would have */
+static unsigned wake_mask;      /* Nominal ticks, counting back from now */
+
+/* expire -- record an expiry of timer i and set its next time */
+static void expire(int i)
+{
+    unsigned late = (millis - timer[i].next) / TICK;
+    if (late < 32)
+        wake_mask |= BIT(late);
+    else
+        n_nominal++;
+
+    if (timer[i].link == UNLISTED) {
+        timer[i].link = owed_list;
+        owed_list = i;
+    }
+    if (timer[i].owed < 0xffff) timer[i].owed++;
+    timer[i].due = timer[i].next;
+
+    if (timer[i].period > 0) {
+        timer[i].next += timer[i].period;
+        sift_down(timer[i].pos);
+    } else {
+        heap_delete(i);
+    }
+}
+
+/* deliver_owed -- try to send PING messages that are owed */
+static void deliver_owed(void)
+{
+    int i, prev = -1, next;
+    message m;
+
+    for (i = owed_list; i >= 0; i = next) {
+        next = timer[i].link;
+
+        if (timer[i].owed > 0) {
+            m.type = PING;
+            m.int1 = timer[i].due;
+            m.int2 = timer[i].owed - 1;
+            if (! post(timer[i].client, &m)) {
+                prev = i;
+                continue;
+            }
+        }
+
+        /* Take the timer off the list, and free it if it was
+           cancelled or is a one-shot timer that has finished */
+        if (prev < 0)
+            owed_list = next;
+        else
+            timer[prev].link = next;
+        timer[i].owed = 0;
+        timer[i].link = UNLISTED;
+        if (timer[i].client < 0) {
+            timer[i].pos = free_list;
+            free_list = i;
+        } else if (timer[i].pos < 0) {
+            release(i);
         }
     }
 }
 
-/* create -- create a new timer */
-static void create(int client, int delay, int repeat) {
-    int i = 0;
+/* coalesce -- expire timers that are due early on a wakeup */
+static void coalesce(void)
+{
+    int k = 0;
+
+    while (k < n_heap) {
+        int i = heap[k];
+
+        if (before(millis, timer[i].next)) {
+            k++;
+            continue;
+        }
+
+        /* Expiry moves the timer down or out of the heap, and usually
+           brings another timer to place k; one that moves above k
+           instead must wait for a later wakeup */
+        expire(i);
+    }
+}
 
-    while (i < MAX_TIMERS && timer[i].client >= 0)
-        i++;
+/* ticked -- time last passed to the kernel */
+static unsigned ticked = 0;
 
-    if (i == MAX_TIMERS)
+/* check_timers -- deal with a tick; called from the interrupt handler */
+static void check_timers(void)
+{
+    /* Usually one tick, but more if ticks were missed */
+    tick_intr(millis - ticked);
+    ticked = millis;
+
+    if (n_heap > 0 && ! before(millis, deadline(heap[0]))) {
+        wake_mask = 0;
+        while (n_heap > 0 && ! before(millis, deadline(heap[0])))
+            expire(heap[0]);
+        if (max_slack > 0) coalesce();
+
+        n_wakeups++;
+        while (wake_mask != 0) {
+            wake_mask &= wake_mask-1;
+            n_nominal++;
+        }
+    }
+
+    if (owed_list >= 0) deliver_owed();
+}
+
+/* create -- create a new timer and return its handle */
+static int create(int client, int delay, int repeat) {
+    int i, h;
+
+    intr_disable();
+    i = free_list;
+    if (i < 0) {
+        intr_enable();
         panic("Too many timers");
+    }
+    free_list = timer[i].pos;
 
     /* If we are between ticks when the timer is created, then the
        timer will go off up to one tick early.  We could add on a tick
@@ -67,23 +351,52 @@ static void create(int client, int delay, int repeat) {
        tick, then the effect is what is usually wanted. */
 
     timer[i].client = client;
+    timer[i].owed = 0;
     timer[i].next = millis + delay;
     timer[i].period = repeat;
+    timer[i].slack = 0;
+    heap_insert(i);
+    h = handle(i);
+    intr_enable();
+
+    return h;
 }
 
+#ifndef TIMER_RTC
 /* timer1_handler -- interrupt handler */
 void timer1_handler(void) {
     // Update the time here so it is accessible to timer_micros
     if (TIMER1_COMPARE[0]) {
+#ifdef UBIT_V2
+        // The count since the compare event is our wakeup latency
+        TIMER1_CAPTURE[3] = 1;
+        idle_wakeup(TIMER1_CC[3]);
+#endif
         millis += TICK;
+        clock_update();
         TIMER1_COMPARE[0] = 0;
-        interrupt(TIMER_TASK);
+        check_timers();
     }
 }
+#endif
 
-static void timer_task(int n) {
-    message m;
+static void periodic_init(void);
+static void usec_init(void);
 
+/* timer_init -- start the clock */
+void timer_init(void) {
+    for (int i = MAX_TIMERS-1; i >= 0; i--) {
+        timer[i].client = -1;
+        timer[i].gen = 1;
+        timer[i].link = UNLISTED;
+        timer[i].pos = free_list;
+        free_list = i;
+    }
+
+    periodic_init();
+    usec_init();
+
+#ifndef TIMER_RTC
     /* We use Timer 1 because its 16-bit mode is adequate for a clock
        with up to 1us resolution and 1ms period, leaving the 32-bit
        Timer 0 for other purposes. */
@@ -97,35 +410,7 @@ static void timer_task(int n) {
     TIMER1_INTENSET = BIT(TIMER_INT_COMPARE0);
     TIMER1_START = 1;
     enable_irq(TIMER1_IRQ);
-    priority(P_HANDLER);
-
-    while (1) {
-        receive(ANY, &m);
-
-        switch (m.type) {
-        case INTERRUPT:
-            tick(TICK);
-            check_timers();
-            break;
-
-        case REGISTER:
-            create(m.sender, m.int1, m.int2);
-            break;
-
-        default:
-            badmesg(m.type);
-        }
-    }
-}
-
-/* timer_init -- start the timer task */
-void timer_init(void) {
-    int i;
-
-    for (i = 0; i < MAX_TIMERS; i++)
-        timer[i].client = -1;
-
-    TIMER_TASK = start("Timer", timer_task, 0, 256);
+#endif
 }
 
 /* timer_now -- return current time in milliseconds since startup */
@@ -139,52 +424,624 @@ difference of two readings with unsigned subtraction. */
 
 /* timer_micros -- return microseconds since startup */
 unsigned timer_micros(void) {
-    unsigned my_millis, ticks1, ticks2, extra;
-    
-    /* We must allow for the possibility the timer has expired but the
-       interrupt has not yet been handled. Worse, the timer expiry
-       could happen between looking at the timer and looking at the
-       interrupt flag.  The approach is to take two readings with
-       interrupts disabled, one before and one after checking the
-       flag.  If the flag is set, but the value has not gone down
-       between the two readings, that indicates the expiry happened
-       before the first reading, so an extra tick should be added.*/
+    return timer_ucount();
+}
+
+/* timer_next -- microseconds until a timer is next due, or -1 if none */
+int timer_next(void) {
+    unsigned now = timer_micros(), prev, next, due;
+    int empty;
 
+    /* Called by the idle policy: restore the interrupt state */
+    prev = get_primask();
     intr_disable();
-    TIMER1_CAPTURE[1] = 1;      // Capture count before testing event
-    extra = TIMER1_COMPARE[0];  // Inspect the expiry event
-    TIMER1_CAPTURE[2] = 1;      // Capture count afterwards
-    my_millis = millis;
-    intr_enable();
-    ticks1 = TIMER1_CC[1];
-    ticks2 = TIMER1_CC[2];
+    empty = (n_heap == 0);
+    if (! empty) next = deadline(heap[0]);
+    set_primask(prev);
+
+    if (empty) return -1;
 
-    /* Correct my_millis if the timer expired */
-    if (extra && ticks1 <= ticks2) my_millis += TICK;
+    /* millis is a multiple of TICK, and a timer fires on the first
+       tick when millis >= next */
+    if (! before(millis, next)) return 0;
+    if (next - millis > 1000000) return 0x7fffffff;
 
-    return 1000 * my_millis + ticks1;
+    due = millis + TICK * ((next - millis + TICK - 1) / TICK);
+    if ((int) (1000 * due - now) < 0) return 0;
+    return 1000 * due - now;
 }
 
 /* timer_delay -- one-shot delay */
 void timer_delay(int msec) {
-    message m;
-    m.type = REGISTER;
-    m.int1 = msec;
-    m.int2 = 0;                 /* Don't repeat */
-    send(TIMER_TASK, &m);
+    create(current_pid(), msec, 0);
     receive(PING, NULL);
 }
 
-/* timer_pulse -- regular pulse */
-void timer_pulse(int msec) {
-    message m;
-    m.type = REGISTER;
-    m.int1 = msec;
-    m.int2 = msec;              /* Repetitive */
-    send(TIMER_TASK, &m);
+/* timer_once -- one-shot PING after a delay; return handle */
+int timer_once(int msec) {
+    return create(current_pid(), msec, 0);
+}
+
+/* timer_pulse -- regular pulse; return handle */
+int timer_pulse(int msec) {
+    return create(current_pid(), msec, msec);
+}
+
+/* timer_cancel -- stop a timer; return OK, or ERR if already gone.
+   Any PING that is owed is not sent. */
+int timer_cancel(int h) {
+    int i;
+
+    intr_disable();
+    i = find(h);
+    if (i < 0) {
+        intr_enable();
+        return ERR;
+    }
+    if (timer[i].pos >= 0) heap_delete(i);
+    release(i);
+    intr_enable();
+    return OK;
+}
+
+/* timer_modify -- restart a timer with a new delay and period, and
+   forget any PING that is owed */
+int timer_modify(int h, int msec, int repeat) {
+    int i;
+
+    intr_disable();
+    i = find(h);
+    if (i < 0) {
+        intr_enable();
+        return ERR;
+    }
+    timer[i].owed = 0;
+    timer[i].next = millis + msec;
+    timer[i].period = repeat;
+    if (timer[i].pos < 0)
+        heap_insert(i);
+    else {
+        sift_up(timer[i].pos);
+        sift_down(timer[i].pos);
+    }
+    intr_enable();
+    return OK;
+}
+
+/* timer_slack -- allow a timer to expire up to msec late, so that it
+   can expire together with others; return OK or ERR */
+int timer_slack(int h, int msec) {
+    int i;
+
+    intr_disable();
+    i = find(h);
+    if (i < 0) {
+        intr_enable();
+        return ERR;
+    }
+    /* Timers expire on ticks, so make the deadline the last tick
+       that is no more than msec after the due time */
+    timer[i].slack = (msec < TICK ? 0 : msec - (TICK-1));
+    if (timer[i].slack > max_slack) max_slack = timer[i].slack;
+    if (timer[i].pos >= 0) {
+        sift_up(timer[i].pos);
+        sift_down(timer[i].pos);
+    }
+    intr_enable();
+    return OK;
+}
+
+/* timer_wakeups -- count ticks on which timers expired, and the
+   wakeups saved by slack */
+void timer_wakeups(unsigned *wakeups, unsigned *saved) {
+    *wakeups = n_wakeups;
+    *saved = n_nominal - n_wakeups;
 }
 
 /* wait -- sleep until next timer pulse */
 void timer_wait(void) {
     receive(PING, NULL);
 }
+
+
+/* PERIODIC PROCESSES */
+
+/* A process that calls timer_periodic(msec) is released every msec
+milliseconds by a pulse timer, and calls wait_next_period() when each
+job is done.  On each release, the lateness of the process in starting
+(the release jitter) is measured from the time the timer was due, and
+when the job finishes, so is its response time.  A job whose response
+time exceeds the period is counted as an overrun, and releases that
+fell due while it was still running are counted as missed.  The
+statistics appear in the process dump, and timer_period_stats() lets
+a program check them against its timing budget.  A periodic process
+should not use other timers, because their PINGs would be taken for
+releases. */
+
+#define MAX_PERIODIC 8
+
+static struct {
+    short pid;                  /* Process, or -1 if free */
+    int handle;                 /* Pulse timer that releases it */
+    unsigned release;           /* Due time of latest release (usec) */
+    period_stats stats;
+} periodic[MAX_PERIODIC];
+
+/* periodic_init -- mark all records free */
+static void periodic_init(void) {
+    for (int i = 0; i < MAX_PERIODIC; i++)
+        periodic[i].pid = -1;
+}
+
+/* find_periodic -- index of record for a process, or -1 */
+static int find_periodic(int pid) {
+    for (int i = 0; i < MAX_PERIODIC; i++) {
+        if (periodic[i].pid == pid) return i;
+    }
+    return -1;
+}
+
+/* timer_periodic -- make the current process periodic, starting from
+   now and with zeroed statistics */
+void timer_periodic(int msec) {
+    int pid = current_pid(), i;
+
+    intr_disable();
+    i = find_periodic(pid);
+    if (i < 0) {
+        i = find_periodic(-1);
+        if (i < 0) {
+            intr_enable();
+            panic("Too many periodic processes");
+        }
+        periodic[i].pid = pid;
+        periodic[i].handle = -1;
+    }
+    intr_enable();
+
+    memset(&periodic[i].stats, 0, sizeof(period_stats));
+    periodic[i].stats.period = msec;
+    periodic[i].release = 1000 * millis;
+    if (timer_modify(periodic[i].handle, msec, msec) != OK)
+        periodic[i].handle = timer_pulse(msec);
+}
+
+/* wait_next_period -- finish a job and wait to be released again;
+   return the number of releases missed */
+int wait_next_period(void) {
+    int i = find_periodic(current_pid());
+    period_stats *s;
+    unsigned resp, jitter;
+    message m;
+
+    if (i < 0) panic("wait_next_period without timer_periodic");
+    s = &periodic[i].stats;
+
+    if (s->releases > 0) {
+        resp = timer_micros() - periodic[i].release;
+        s->done++;
+        s->resp_total += resp;
+        if (resp > s->resp_max) s->resp_max = resp;
+        if (resp > 1000 * s->period) s->overruns++;
+    }
+
+    receive(PING, &m);
+    periodic[i].release = 1000 * m.int1;
+    jitter = timer_micros() - periodic[i].release;
+    if ((int) jitter < 0) jitter = 0;
+
+    s->releases++;
+    s->missed += m.int2;
+    s->jitter_total += jitter;
+    if (jitter > s->jitter_max) s->jitter_max = jitter;
+    return m.int2;
+}
+
+/* timer_period_stats -- timing statistics for a periodic process, or
+   NULL if the process is not periodic */
+period_stats *timer_period_stats(int pid) {
+    int i = find_periodic(pid);
+    if (i < 0) return NULL;
+    return &periodic[i].stats;
+}
+
+
+/* MICROSECOND TIMERS */
+
+/* Timer 0 counts microseconds in 32 bits, independently of the tick,
+and compare channels 0 to 2 give up to three processes at once a
+wakeup at a precise time; channel 3 captures the current count.  The
+compare interrupt wakes the process with interrupt(), at once rather
+than on the next tick.  So that the process doesn't wake
+late, the compare is set for a little before the deadline, and the
+process spins for the rest of the time.  The lead is adjusted as we
+go to cover the measured wakeup latency, and statistics record how far
+the process was from the deadline when it was released. */
+
+#define N_UCHAN 3               /* Compare channels for wakeups */
+#define MAX_LEAD 1000           /* Limit on lead time (usec) */
+
+static int uclient[N_UCHAN];    /* Process waiting on each channel, or -1 */
+static unsigned ulead = 20;     /* Current lead time (usec) */
+
+static unsigned u_count = 0;    /* Number of waits */
+static unsigned u_total = 0;    /* Total lateness (usec) */
+static unsigned u_worst = 0;    /* Worst lateness (usec) */
+
+#ifdef TIMER_RTC
+static void rtc_init(void);
+static int rtc_arm(int c, unsigned wake);
+#endif
+
+/* usec_init -- start the microsecond counter */
+static void usec_init(void) {
+    for (int c = 0; c < N_UCHAN; c++)
+        uclient[c] = -1;
+
+#ifdef TIMER_RTC
+    rtc_init();
+#else
+    TIMER0_STOP = 1;
+    TIMER0_MODE = TIMER_MODE_Timer;
+    TIMER0_BITMODE = TIMER_BITMODE_32Bit;
+    TIMER0_PRESCALER = 4;       // 1MHz = 16MHz / 2^4
+    TIMER0_CLEAR = 1;
+    TIMER0_SHORTS = 0;
+    TIMER0_INTENSET = BIT(TIMER_INT_COMPARE0) | BIT(TIMER_INT_COMPARE1)
+        | BIT(TIMER_INT_COMPARE2);
+    TIMER0_START = 1;
+    enable_irq(TIMER0_IRQ);
+#endif
+}
+
+/* uwake -- wake the process waiting on channel c, if any */
+static inline void uwake(int c) {
+    if (uclient[c] >= 0) {
+        interrupt(uclient[c]);
+        uclient[c] = -1;
+    }
+}
+
+#ifndef TIMER_RTC
+
+/* The compare interrupts stay enabled: a channel that is not in use
+matches again only when the count wraps around after 71 minutes, and
+then nobody is woken. */
+
+/* timer0_handler -- wake processes whose compare time has come */
+void timer0_handler(void) {
+    for (int c = 0; c < N_UCHAN; c++) {
+        if (TIMER0_COMPARE[c]) {
+            TIMER0_COMPARE[c] = 0;
+            uwake(c);
+        }
+    }
+}
+
+/* Reading the counter means triggering a capture task and then
+reading the register, and we do it without disabling interrupts.  If
+an interrupt handler reads the counter in between, we get the later
+value it captured, which is still a time between our call and return.
+So the result is always good. */
+
+/* timer_ucount -- current value of the microsecond counter */
+unsigned timer_ucount(void) {
+    TIMER0_CAPTURE[3] = 1;
+    return TIMER0_CC[3];
+}
+
+/* uarm -- set channel c to interrupt at time wake; return 0 if too late */
+static int uarm(int c, unsigned wake) {
+    TIMER0_CC[c] = wake;
+    TIMER0_COMPARE[c] = 0;
+    return ((int) (wake - timer_ucount()) > 0);
+}
+#else
+/* timer_ucount -- current value of the microsecond counter */
+unsigned timer_ucount(void) {
+    return timer_clock();
+}
+
+#define uarm(c, wake) rtc_arm(c, wake)
+#endif
+
+/* timer_uwait -- wait until the counter reaches a given value.  The
+   process must not be handling interrupts of its own, because it
+   waits for an INTERRUPT message. */
+void timer_uwait(unsigned when) {
+    unsigned wake = when - ulead, now;
+    int c;
+
+    intr_disable();
+    for (c = 0; c < N_UCHAN && uclient[c] >= 0; c++) { }
+    if (c == N_UCHAN) {
+        intr_enable();
+        panic("Too many microsecond timers");
+    }
+
+    if (uarm(c, wake)) {
+        uclient[c] = current_pid();
+        intr_enable();
+        receive(INTERRUPT, NULL);
+
+        /* Adjust the lead: quickly up if we were late, slowly down */
+        now = timer_ucount();
+        int lat = now - wake;
+        if (lat < 0) lat = 0;
+        if (lat > MAX_LEAD) lat = MAX_LEAD;
+        if (lat + 2 > ulead)
+            ulead = lat + 2;
+        else
+            ulead -= (ulead - lat - 2 + 15) / 16;
+    } else {
+        intr_enable();
+        now = timer_ucount();
+    }
+
+    /* Spin for the last few microseconds */
+    while ((int) (when - now) > 0)
+        now = timer_ucount();
+
+    u_count++;
+    u_total += now - when;
+    if (now - when > u_worst) u_worst = now - when;
+}
+
+/* timer_udelay -- wait for a number of microseconds */
+void timer_udelay(unsigned usec) {
+    timer_uwait(timer_ucount() + usec);
+}
+
+/* timer_ustats -- report mean and worst lateness of waits (usec) */
+void timer_ustats(unsigned *count, unsigned *mean, unsigned *worst) {
+    *count = u_count;
+    *mean = (u_count == 0 ? 0 : u_total / u_count);
+    *worst = u_worst;
+}
+
+
+/* 64-BIT CLOCK */
+
+/* The clock extends the 32-bit microsecond count of Timer 0 (or the
+24-bit count of the RTC) to 64 bits, so it will not wrap around in the
+lifetime of the board.  The high word is kept up to date from the tick
+interrupt, which notes the low word each time, so a wrap-around shows
+as a smaller count.  Each update bumps a sequence number before and
+after, and a reader takes its snapshot of the high word and the old
+low word again if the sequence number changed meanwhile; it never
+disables interrupts.  On one core the update can't be interrupted by a
+reader, so the sequence number is never odd when a reader sees it, but
+the test costs little. */
+
+#ifdef TIMER_RTC
+#define CLOCK_BITS 24
+#define clock_count() RTC1_COUNTER
+#define clock_usec(t) (((t) * 15625) >> 9) /* 10^6/32768 = 15625/2^9 */
+#else
+#define CLOCK_BITS 32
+#define clock_count() timer_ucount()
+#define clock_usec(t) (t)
+#endif
+
+static volatile unsigned clock_seq = 0; /* Odd while being updated */
+static volatile unsigned clock_hi = 0;  /* High word of the clock */
+static volatile unsigned clock_lo = 0;  /* Low word at last update */
+
+/* clock_update -- extend the clock; called on each tick */
+static void clock_update(void) {
+    unsigned lo = clock_count();
+
+    clock_seq++;
+    if (lo < clock_lo) clock_hi++;
+    clock_lo = lo;
+    clock_seq++;
+}
+
+/* timer_clock -- microseconds since startup as a 64-bit number */
+unsigned long long timer_clock(void) {
+    unsigned seq, hi, last, lo;
+
+    do {
+        seq = clock_seq;
+        hi = clock_hi;
+        last = clock_lo;
+        lo = clock_count();
+    } while ((seq & 1) || seq != clock_seq);
+
+    if (lo < last) hi++;
+    return clock_usec(((unsigned long long) hi << CLOCK_BITS) | lo);
+}
+
+
+#ifdef TIMER_RTC
+/* RTC */
+
+/* RTC1 counts at 32768Hz in 24 bits, wrapping around every 512 sec.
+Compare channel 0 gives the tick, and channels 1 to 3 serve for the
+microsecond wakeups.  A millisecond is 32.768 RTC ticks, so the time
+of the next tick is kept with a fractional part in thousandths, and
+the ticks come at intervals of 32 or 33 counts that average out
+exactly.  A compare register must be set at least two counts ahead of
+the counter to be sure of an event, and if the handler is held up for
+so long that the next tick would be missed, the missed ticks are
+counted at once so that millis stays in step with the RTC. */
+
+#define RTC_MASK 0xffffff
+#define RTC_HALF 0x800000
+
+static unsigned rtc_next;       /* Count at next tick */
+static unsigned rtc_frac = 0;   /* Fraction of a count in rtc_next (/1000) */
+
+/* rtc_ahead -- test if a compare for count t will be in time */
+static int rtc_ahead(unsigned t) {
+    unsigned d = (t - RTC1_COUNTER) & RTC_MASK;
+    return (d >= 2 && d < RTC_HALF);
+}
+
+/* rtc_step -- advance the tick compare by one tick */
+static void rtc_step(void) {
+    for (int i = 0; i < TICK; i++) {
+        rtc_next += 32;
+        rtc_frac += 768;
+        if (rtc_frac >= 1000) {
+            rtc_frac -= 1000;
+            rtc_next++;
+        }
+    }
+
+    RTC1_CC[0] = rtc_next & RTC_MASK;
+}
+
+/* The RC oscillator for the low-frequency clock drifts with
+temperature, so the calibration timer in the CLOCK peripheral gives a
+CTTO event every CAL_INTERVAL quarter-seconds, and we then calibrate
+the oscillator against the crystal with the CAL task.  The crystal
+must be running for that, and takes a fraction of a millisecond to
+start, so the handler starts it and the tick handler looks to see if
+it is ready; that avoids waiting in the handler, and it leaves the
+HFCLKSTARTED event alone.  When the DONE event comes, the calibration
+timer is restarted, and the crystal is stopped again unless someone
+else needs it.  Drivers and programs that need the crystal say so by
+calling timer_xtal(), which keeps a count of them; that is checked
+when calibration finishes, so the crystal is not stopped under a user
+that asked for it while calibration was in progress. */
+
+#define CAL_INTERVAL 16         /* Calibration interval (1/4 sec) */
+
+#define CAL_IDLE 0              /* Waiting for calibration timer */
+#define CAL_XTAL 1              /* Waiting for crystal to start */
+#define CAL_RUN 2               /* Waiting for DONE */
+
+static int cal_state = CAL_IDLE;
+static int cal_stop;            /* Whether crystal may stop when done */
+static int xtal_users = 0;      /* Number of timer_xtal(1) requests */
+
+/* xtal_running -- test if the high-frequency clock runs from the crystal */
+static int xtal_running(void) {
+    unsigned stat = CLOCK_HFCLKSTAT;
+    return ((stat & CLOCK_HFCLKSTAT_STATE)
+            && (stat & CLOCK_HFCLKSTAT_SRC));
+}
+
+/* cal_begin -- start the crystal for a calibration.  If it is already
+   running but nobody has asked for it with timer_xtal(), then it was
+   started by other means, and is left running afterwards. */
+static void cal_begin(void) {
+    cal_stop = (xtal_users > 0 || ! xtal_running());
+    if (! xtal_running()) CLOCK_HFCLKSTART = 1;
+    cal_state = CAL_XTAL;
+}
+
+/* cal_poll -- start calibrating if the crystal is ready; called on ticks */
+static void cal_poll(void) {
+    if (xtal_running()) {
+        CLOCK_CAL = 1;
+        cal_state = CAL_RUN;
+    }
+}
+
+/* power_clock_handler -- interrupt handler for calibration */
+void power_clock_handler(void) {
+    if (CLOCK_CTTO) {
+        CLOCK_CTTO = 0;
+        cal_begin();
+    }
+
+    if (CLOCK_DONE) {
+        CLOCK_DONE = 0;
+        if (cal_stop && xtal_users == 0) CLOCK_HFCLKSTOP = 1;
+        cal_state = CAL_IDLE;
+        CLOCK_CTSTART = 1;
+    }
+}
+
+/* timer_xtal -- ask for the crystal to run (on = 1), waiting until it
+   is ready, or give up a previous request (on = 0) */
+void timer_xtal(int on) {
+    intr_disable();
+    if (on) {
+        xtal_users++;
+        if (! xtal_running()) CLOCK_HFCLKSTART = 1;
+    } else if (xtal_users > 0) {
+        xtal_users--;
+        if (xtal_users == 0 && cal_state == CAL_IDLE)
+            CLOCK_HFCLKSTOP = 1;
+    }
+    intr_enable();
+
+    if (on) {
+        while (! xtal_running()) { }
+    }
+}
+
+/* rtc_init -- start the low-frequency clock and the RTC.  Ticks are
+   counted from when the RTC starts, so millis agrees with timer_micros(). */
+static void rtc_init(void) {
+    CLOCK_LFCLKSRC = CLOCK_LFCLKSRC_RC;
+    CLOCK_LFCLKSTARTED = 0;
+    CLOCK_LFCLKSTART = 1;
+    while (! CLOCK_LFCLKSTARTED) { }
+
+    /* Calibrate now, and then at intervals */
+    CLOCK_CTIV = CAL_INTERVAL;
+    CLOCK_CTTO = 0;
+    CLOCK_DONE = 0;
+    CLOCK_INTENSET = BIT(CLOCK_INT_CTTO) | BIT(CLOCK_INT_DONE);
+    enable_irq(POWER_CLOCK_IRQ);
+    cal_begin();
+
+    RTC1_STOP = 1;
+    RTC1_PRESCALER = 0;         // 32768Hz
+    RTC1_CLEAR = 1;
+    rtc_next = 0;
+    rtc_step();
+    RTC1_INTENSET = BIT(RTC_INT_COMPARE0) | BIT(RTC_INT_COMPARE1)
+        | BIT(RTC_INT_COMPARE2) | BIT(RTC_INT_COMPARE3);
+    RTC1_START = 1;
+    enable_irq(RTC1_IRQ);
+}
+
+/* rtc1_handler -- interrupt handler for tick and wakeups.  The wakeup
+   latency is not reported to the idle policy, because the RTC cannot
+   measure it finely enough. */
+void rtc1_handler(void) {
+    if (RTC1_COMPARE[0]) {
+        RTC1_COMPARE[0] = 0;
+        do {
+            millis += TICK;
+            rtc_step();
+        } while (! rtc_ahead(rtc_next));
+        clock_update();
+        if (cal_state == CAL_XTAL) cal_poll();
+        check_timers();
+    }
+
+    for (int c = 0; c < N_UCHAN; c++) {
+        if (RTC1_COMPARE[c+1]) {
+            RTC1_COMPARE[c+1] = 0;
+            uwake(c);
+        }
+    }
+}
+
+/* rtc_arm -- set channel c to interrupt at or a little before time
+   wake; return 0 if that is too soon for the RTC */
+static int rtc_arm(int c, unsigned wake) {
+    unsigned count = RTC1_COUNTER, t;
+    int d = wake - timer_ucount();
+
+    if (d <= 0) return 0;
+
+    /* Convert d to RTC counts, rounding up, and without overflow */
+    t = count + (d / 15625) * 512 + ((d % 15625) * 512 + 15624) / 15625;
+    RTC1_CC[c+1] = t & RTC_MASK;
+    RTC1_COMPARE[c+1] = 0;
+    return rtc_ahead(t);
+}
+
+#else
+
+/* timer_xtal -- nothing to do: without RTC=1, the crystal always runs */
+void timer_xtal(int on) {
+}
+#endif
@@ -81,10 +81,15 @@ argument to be a macro that expands the a 'position, width' pair. */
 #define I2C_EXTERNAL 0
 #define SPI_CHAN 1
 
+/* One UART, connected to the USB interface */
+#define N_UART 1
+#define UART_USB 0
+
 
 /* Interrupts */
 #define SVC_IRQ    -5
 #define PENDSV_IRQ -2
+#define POWER_CLOCK_IRQ 0
 #define RADIO_IRQ   1
 #define UART_IRQ    2
 #define I2C0_IRQ    3
@@ -98,6 +103,7 @@ argument to be a macro that expands the a 'position, width' pair. */
 #define TEMP_IRQ   12
 #define RNG_IRQ    13
 #define RTC1_IRQ   17
+#define SWI0_IRQ   20
 
 #define N_INTERRUPTS 32
 
@@ -148,16 +154,40 @@ INSTANCE nvic NVIC @ 0xe000e000;
 
 /* Clock control */
 DEVICE clock {
+/* Tasks */
     REGISTER unsigned HFCLKSTART @ 0x000;
+    REGISTER unsigned HFCLKSTOP @ 0x004;
     REGISTER unsigned LFCLKSTART @ 0x008;
+    REGISTER unsigned LFCLKSTOP @ 0x00c;
+    REGISTER unsigned CAL @ 0x010;
+    REGISTER unsigned CTSTART @ 0x014;
+    REGISTER unsigned CTSTOP @ 0x018;
+/* Events */
     REGISTER unsigned HFCLKSTARTED @ 0x100;
     REGISTER unsigned LFCLKSTARTED @ 0x104;
+    REGISTER unsigned DONE @ 0x10c;
+    REGISTER unsigned CTTO @ 0x110;
+/* Registers */
+    REGISTER unsigned INTENSET @ 0x304;
+    REGISTER unsigned INTENCLR @ 0x308;
+    REGISTER unsigned HFCLKSTAT @ 0x40c;
+#define   CLOCK_HFCLKSTAT_SRC __BIT(0)
+#define   CLOCK_HFCLKSTAT_STATE __BIT(16)
     REGISTER unsigned LFCLKSRC @ 0x518;
 #define   CLOCK_LFCLKSRC_RC 0
+#define   CLOCK_LFCLKSRC_Xtal 1
+#define   CLOCK_LFCLKSRC_Synth 2
+    REGISTER unsigned CTIV @ 0x538;
     REGISTER unsigned XTALFREQ @ 0x550;
 #define   CLOCK_XTALFREQ_16MHz 0xFF
 };
 
+/* Interrupts */
+#define CLOCK_INT_HFCLKSTARTED 0
+#define CLOCK_INT_LFCLKSTARTED 1
+#define CLOCK_INT_DONE 3
+#define CLOCK_INT_CTTO 4
+
 INSTANCE clock CLOCK @ 0x40000000;
 
 
@@ -482,6 +512,38 @@ INSTANCE timer TIMER1 @ 0x40009000;
 INSTANCE timer TIMER2 @ 0x4000a000;
 
 
+/* Real time clocks: 24 bit counters driven by the 32.768kHz LFCLK */
+DEVICE rtc {
+/* Tasks */
+    REGISTER unsigned START @ 0x000;
+    REGISTER unsigned STOP @ 0x004;
+    REGISTER unsigned CLEAR @ 0x008;
+    REGISTER unsigned TRIGOVRFLW @ 0x00c;
+/* Events */
+    REGISTER unsigned OVRFLW @ 0x104;
+    REGISTER unsigned COMPARE[4] @ 0x140;
+/* Registers */
+    REGISTER unsigned INTENSET @ 0x304;
+    REGISTER unsigned INTENCLR @ 0x308;
+    REGISTER unsigned EVTENSET @ 0x344;
+    REGISTER unsigned EVTENCLR @ 0x348;
+    REGISTER unsigned COUNTER @ 0x504;
+    REGISTER unsigned PRESCALER @ 0x508;
+    REGISTER unsigned CC[4] @ 0x540;
+};
+
+/* Interrupts */
+#define RTC_INT_OVRFLW 1
+#define RTC_INT_COMPARE0 16
+#define RTC_INT_COMPARE1 17
+#define RTC_INT_COMPARE2 18
+#define RTC_INT_COMPARE3 19
+
+INSTANCE rtc RTC0 @ 0x4000b000;
+
+INSTANCE rtc RTC1 @ 0x40011000;
+
+
 /* Random Number Generator */
 DEVICE rng {
 /* Tasks */
@@ -812,6 +874,15 @@ typedef unsigned image[NIMG];
 #define led_off()   GPIO_OUTCLR = LED_MASK
 
 
+/* CODERAM -- mark function for copying to RAM with 'make RAMCODE=1'.
+Inline functions may be marked too, in case GCC decides not to inline
+them. */
+#ifdef RAMCODE
+#define CODERAM  __attribute((section(".xram")))
+#else
+#define CODERAM
+#endif
+
 /* A few assembler macros for single instructions. */
 #define pause()         asm volatile ("wfe")
 #define intr_disable()  asm volatile ("cpsid i")
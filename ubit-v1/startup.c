@@ -15,13 +15,47 @@ void default_start(void)
 void __start(void) __attribute((weak, alias("default_start")));
 
 /* The next four routines can be used in C compiler output, even if
-not mentioned in the source. */
+not mentioned in the source.  memcpy and memset are used for copying
+the data segment at startup, for display images and radio packets,
+and for every structure assignment, so it is worth making them fast.
+When source and destination are aligned alike, they move whole words,
+and memcpy moves blocks of four words at a time using LDM and STM with
+the low registers that are all the Cortex-M0 lets us name.  Bytes
+before the first word boundary and after the last are copied singly. */
+
+/* BLOCK -- bytes moved by each LDM/STM pair in memcpy */
+#define BLOCK 16
+
+/* copy_block -- copy BLOCK bytes and advance both pointers */
+#define copy_block(p, q) \
+    asm volatile ("ldm %1!, {r3-r6}\n\tstm %0!, {r3-r6}" \
+                  : "+l"(p), "+l"(q) : : "r3", "r4", "r5", "r6", "memory")
+
+/* aligned -- test whether a pointer is word-aligned */
+#define aligned(p) (((unsigned) (p) & 0x3) == 0)
 
 /* memcpy -- copy n bytes from src to dest (non-overlapping) */
 void *memcpy(void *dest, const void *src, unsigned n)
 {
+    /* This version copies upwards, and memmove relies on that. */
     unsigned char *p = dest;
     const unsigned char *q = src;
+
+    if (aligned((unsigned) p ^ (unsigned) q)) {
+        while (n > 0 && ! aligned(p)) {
+            *p++ = *q++; n--;
+        }
+
+        while (n >= BLOCK) {
+            copy_block(p, q); n -= BLOCK;
+        }
+
+        while (n >= 4) {
+            * (unsigned *) p = * (const unsigned *) q;
+            p += 4; q += 4; n -= 4;
+        }
+    }
+
     while (n-- > 0) *p++ = *q++;
     return dest;
 }
@@ -31,12 +65,26 @@ void *memmove(void *dest, const void *src, unsigned n)
 {
     unsigned char *p = dest;
     const unsigned char *q = src;
+
+    /* An upward copy is safe if the destination is below the source,
+       even with LDM/STM, because each block is loaded before it is
+       stored. */
     if (dest <= src)
-        while (n-- > 0) *p++ = *q++;
-    else {
-        p += n; q += n;
-        while (n-- > 0) *--p = *--q;
+        return memcpy(dest, src, n);
+
+    p += n; q += n;
+    if (aligned((unsigned) p ^ (unsigned) q)) {
+        while (n > 0 && ! aligned(p)) {
+            *--p = *--q; n--;
+        }
+
+        while (n >= 4) {
+            p -= 4; q -= 4; n -= 4;
+            * (unsigned *) p = * (const unsigned *) q;
+        }
     }
+
+    while (n-- > 0) *--p = *--q;
     return dest;
 }
     
@@ -44,6 +92,24 @@ void *memmove(void *dest, const void *src, unsigned n)
 void *memset(void *dest, unsigned x, unsigned n)
 {
     unsigned char *p = dest;
+    unsigned w = (x & 0xff) * 0x01010101;
+
+    while (n > 0 && ! aligned(p)) {
+        *p++ = x; n--;
+    }
+
+    /* Four words per iteration */
+    while (n >= 16) {
+        unsigned *pp = (unsigned *) p;
+        pp[0] = w; pp[1] = w; pp[2] = w; pp[3] = w;
+        p += 16; n -= 16;
+    }
+
+    while (n >= 4) {
+        * (unsigned *) p = w;
+        p += 4; n -= 4;
+    }
+
     while (n-- > 0) *p++ = x;
     return dest;
 }
@@ -60,20 +126,28 @@ int memcmp(const void *pp, const void *qq, int n)
 }
 
 /* Addresses set by the linker */
-extern unsigned char __data_start[], __data_end[],
-    __bss_start[], __bss_end[], __etext[], __stack[];
+extern unsigned char __xram_start[], __xram_end[],
+    __data_start[], __data_end[], __bss_start[], __bss_end[],
+    __etext[], __stack[];
 
 /* __reset -- the system starts here */
 void __reset(void)
 {
-    /* Activate the crystal clock */
+#ifndef TIMER_RTC
+    /* Activate the crystal clock.  With the RTC timer (see timer.c),
+       we run from the internal oscillator, and the radio starts the
+       crystal when it needs it. */
     CLOCK_HFCLKSTARTED = 0;
     CLOCK_HFCLKSTART = 1;
     while (! CLOCK_HFCLKSTARTED) { }
+#endif
 
+    /* Copy xram and data segments and zero out bss. */
+    int xram_size = __xram_end - __xram_start;
     int data_size = __data_end - __data_start;
     int bss_size = __bss_end - __bss_start;
-    memcpy(__data_start, __etext, data_size);
+    memcpy(__xram_start, __etext, xram_size);
+    memcpy(__data_start, __etext+xram_size, data_size);
     memset(__bss_start, 0, bss_size);
 
     __start();
@@ -96,11 +96,20 @@ argument to be a macro that expands the a 'position, width' pair. */
 #define I2C_EXTERNAL 1
 #define SPI_CHAN 2
 
+/* Two UARTs, one connected to the USB interface, another to the
+   edge connector (EDGE_TX, EDGE_RX) */
+#define N_UART 2
+#define UART_USB 0
+#define UART_EDGE 1
+#define EDGE_TX PAD0
+#define EDGE_RX PAD1
+
 
 /* Interrupts */
 #define SVC_IRQ    -5
 #define PENDSV_IRQ -2
 #define SYSTICK_IRQ -1
+#define POWER_CLOCK_IRQ 0
 #define RADIO_IRQ   1
 #define UART0_IRQ   2
 #define I2C0_IRQ    3
@@ -116,6 +125,7 @@ argument to be a macro that expands the a 'position, width' pair. */
 #define TEMP_IRQ   12
 #define RNG_IRQ    13
 #define RTC1_IRQ   17
+#define SWI0_IRQ   20
 #define TIMER3_IRQ 26
 #define TIMER4_IRQ 27
 #define PWM0_IRQ   28
@@ -229,16 +239,40 @@ INSTANCE dwt DWT @ 0xe0001000;
 
 /* Clock control */
 DEVICE clock {
+/* Tasks */
     REGISTER unsigned HFCLKSTART @ 0x000;
+    REGISTER unsigned HFCLKSTOP @ 0x004;
     REGISTER unsigned LFCLKSTART @ 0x008;
+    REGISTER unsigned LFCLKSTOP @ 0x00c;
+    REGISTER unsigned CAL @ 0x010;
+    REGISTER unsigned CTSTART @ 0x014;
+    REGISTER unsigned CTSTOP @ 0x018;
+/* Events */
     REGISTER unsigned HFCLKSTARTED @ 0x100;
     REGISTER unsigned LFCLKSTARTED @ 0x104;
+    REGISTER unsigned DONE @ 0x10c;
+    REGISTER unsigned CTTO @ 0x110;
+/* Registers */
+    REGISTER unsigned INTENSET @ 0x304;
+    REGISTER unsigned INTENCLR @ 0x308;
+    REGISTER unsigned HFCLKSTAT @ 0x40c;
+#define   CLOCK_HFCLKSTAT_SRC __BIT(0)
+#define   CLOCK_HFCLKSTAT_STATE __BIT(16)
     REGISTER unsigned LFCLKSRC @ 0x518;
 #define   CLOCK_LFCLKSRC_RC 0
+#define   CLOCK_LFCLKSRC_Xtal 1
+#define   CLOCK_LFCLKSRC_Synth 2
+    REGISTER unsigned CTIV @ 0x538;
     REGISTER unsigned XTALFREQ @ 0x550;
 #define   CLOCK_XTALFREQ_16MHz 0xFF
 };
 
+/* Interrupts */
+#define CLOCK_INT_HFCLKSTARTED 0
+#define CLOCK_INT_LFCLKSTARTED 1
+#define CLOCK_INT_DONE 3
+#define CLOCK_INT_CTTO 4
+
 INSTANCE clock CLOCK @ 0x40000000;
 
 
@@ -573,6 +607,38 @@ INSTANCE timer TIMER3 @ 0x4001a000;
 INSTANCE timer TIMER4 @ 0x4001b000;
 
 
+/* Real time clocks: 24 bit counters driven by the 32.768kHz LFCLK */
+DEVICE rtc {
+/* Tasks */
+    REGISTER unsigned START @ 0x000;
+    REGISTER unsigned STOP @ 0x004;
+    REGISTER unsigned CLEAR @ 0x008;
+    REGISTER unsigned TRIGOVRFLW @ 0x00c;
+/* Events */
+    REGISTER unsigned OVRFLW @ 0x104;
+    REGISTER unsigned COMPARE[4] @ 0x140;
+/* Registers */
+    REGISTER unsigned INTENSET @ 0x304;
+    REGISTER unsigned INTENCLR @ 0x308;
+    REGISTER unsigned EVTENSET @ 0x344;
+    REGISTER unsigned EVTENCLR @ 0x348;
+    REGISTER unsigned COUNTER @ 0x504;
+    REGISTER unsigned PRESCALER @ 0x508;
+    REGISTER unsigned CC[4] @ 0x540;
+};
+
+/* Interrupts */
+#define RTC_INT_OVRFLW 1
+#define RTC_INT_COMPARE0 16
+#define RTC_INT_COMPARE1 17
+#define RTC_INT_COMPARE2 18
+#define RTC_INT_COMPARE3 19
+
+INSTANCE rtc RTC0 @ 0x4000b000;
+
+INSTANCE rtc RTC1 @ 0x40011000;
+
+
 /* Random Number Generator */
 DEVICE rng {
 /* Tasks */
@@ -1029,6 +1095,16 @@ DEVARRAYS
 
 /* NVIC stuff */
 
+/* The kernel runs at priority KERNEL_PRIO, together with SVC, PendSV
+and every interrupt whose handler calls interrupt(), and it masks them
+by setting BASEPRI rather than PRIMASK.  IRQs given a priority above
+the kernel with irq_urgent() are never masked, so their latency does
+not depend on what the kernel is doing; but their handlers must not
+call interrupt() or anything else in micro:bian. */
+#define KERNEL_PRIO 0x80
+#define N_URGENT 4              /* Urgent levels 0x00, 0x20, 0x40, 0x60 */
+#define URGENT_PRIO(level) ((level) << 5)
+
 /* irq_priority -- set priority of an IRQ from 0 (highest) to 255 */
 void irq_priority(int irq, unsigned priority);
 
@@ -1099,15 +1175,23 @@ typedef unsigned image[NIMG];
 #define led_off()   GPIO0_OUTCLR = LED_MASK0, GPIO1_OUTCLR = LED_MASK1
 
 
-/* CODERAM -- mark function for copying to RAM */
-#define CODERAM  __attribute((noinline, section(".xram")))
-
-/* A few assembler macros for single instructions. */
-#define intr_disable()  asm volatile ("cpsid i")
-#define intr_enable()   asm volatile ("cpsie i")
+/* CODERAM -- mark function for copying to RAM with 'make RAMCODE=1'.
+Inline functions may be marked too, in case GCC decides not to inline
+them. */
+#ifdef RAMCODE
+#define CODERAM  __attribute((section(".xram")))
+#else
+#define CODERAM
+#endif
+
+/* A few assembler macros for single instructions.  Interrupts are
+disabled by raising BASEPRI to KERNEL_PRIO, so urgent ones are still
+taken; get_primask and set_primask save and restore BASEPRI. */
+#define intr_disable()  asm volatile ("msr basepri, %0" : : "r"(KERNEL_PRIO))
+#define intr_enable()   asm volatile ("msr basepri, %0" : : "r"(0))
 #define get_primask()   ({ unsigned x;                                   \
-                           asm volatile ("mrs %0, primask" : "=r"(x)); x; })
-#define set_primask(x)  asm volatile ("msr primask, %0" : : "r"(x))
+                           asm volatile ("mrs %0, basepri" : "=r"(x)); x; })
+#define set_primask(x)  asm volatile ("msr basepri, %0" : : "r"(x))
 #define nop()           asm volatile ("nop")
 
 /* pause() -- disabled on V2 owing to long wakeup time */
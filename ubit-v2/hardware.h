@@ -96,11 +96,20 @@ argument to be a macro that expands the a 'position, width' pair. */
 #define I2C_EXTERNAL 1
 #define SPI_CHAN 2
 
+/* Two UARTs, one connected to the USB interface, another to the
+   edge connector (EDGE_TX, EDGE_RX) */
+#define N_UART 2
+#define UART_USB 0
+#define UART_EDGE 1
+#define EDGE_TX PAD0
+#define EDGE_RX PAD1
+
 
 /* Interrupts */
 #define SVC_IRQ    -5
 #define PENDSV_IRQ -2
 #define SYSTICK_IRQ -1
+#define POWER_CLOCK_IRQ 0
 #define RADIO_IRQ   1
 #define UART0_IRQ   2
 #define I2C0_IRQ    3
@@ -116,6 +125,7 @@ argument to be a macro that expands the a 'position, width' pair. */
 #define TEMP_IRQ   12
 #define RNG_IRQ    13
 #define RTC1_IRQ   17
+#define SWI0_IRQ   20
 #define TIMER3_IRQ 26
 #define TIMER4_IRQ 27
 #define PWM0_IRQ   28
@@ -213,12 +223,36 @@ typedef struct {
 
 /* Clock control */
 
+/* Interrupts */
+#define CLOCK_INT_HFCLKSTARTED 0
+#define CLOCK_INT_LFCLKSTARTED 1
+#define CLOCK_INT_DONE 3
+#define CLOCK_INT_CTTO 4
+
+/* Tasks */
 #define CLOCK_HFCLKSTART                _REG(unsigned, 0x40000000)
+#define CLOCK_HFCLKSTOP                 _REG(unsigned, 0x40000004)
 #define CLOCK_LFCLKSTART                _REG(unsigned, 0x40000008)
+#define CLOCK_LFCLKSTOP                 _REG(unsigned, 0x4000000c)
+#define CLOCK_CAL                       _REG(unsigned, 0x40000010)
+#define CLOCK_CTSTART                   _REG(unsigned, 0x40000014)
+#define CLOCK_CTSTOP                    _REG(unsigned, 0x40000018)
+/* Events */
 #define CLOCK_HFCLKSTARTED              _REG(unsigned, 0x40000100)
 #define CLOCK_LFCLKSTARTED              _REG(unsigned, 0x40000104)
+#define CLOCK_DONE                      _REG(unsigned, 0x4000010c)
+#define CLOCK_CTTO                      _REG(unsigned, 0x40000110)
+/* Registers */
+#define CLOCK_INTENSET                  _REG(unsigned, 0x40000304)
+#define CLOCK_INTENCLR                  _REG(unsigned, 0x40000308)
+#define CLOCK_HFCLKSTAT                 _REG(unsigned, 0x4000040c)
+#define   CLOCK_HFCLKSTAT_SRC __BIT(0)
+#define   CLOCK_HFCLKSTAT_STATE __BIT(16)
 #define CLOCK_LFCLKSRC                  _REG(unsigned, 0x40000518)
 #define   CLOCK_LFCLKSRC_RC 0
+#define   CLOCK_LFCLKSRC_Xtal 1
+#define   CLOCK_LFCLKSRC_Synth 2
+#define CLOCK_CTIV                      _REG(unsigned, 0x40000538)
 #define CLOCK_XTALFREQ                  _REG(unsigned, 0x40000550)
 #define   CLOCK_XTALFREQ_16MHz 0xFF
 
@@ -583,6 +617,47 @@ typedef struct { unsigned volatile *EEP, *TEP; } ppi_chan;
 #define TIMER4_CC                       _ARR(unsigned, 0x4001b540)
 
 
+/* Real time clocks: 24 bit counters driven by the 32.768kHz LFCLK */
+
+/* Interrupts */
+#define RTC_INT_OVRFLW 1
+#define RTC_INT_COMPARE0 16
+#define RTC_INT_COMPARE1 17
+#define RTC_INT_COMPARE2 18
+#define RTC_INT_COMPARE3 19
+
+/* Tasks */
+#define RTC0_START                      _REG(unsigned, 0x4000b000)
+#define RTC0_STOP                       _REG(unsigned, 0x4000b004)
+#define RTC0_CLEAR                      _REG(unsigned, 0x4000b008)
+#define RTC0_TRIGOVRFLW                 _REG(unsigned, 0x4000b00c)
+/* Events */
+#define RTC0_OVRFLW                     _REG(unsigned, 0x4000b104)
+#define RTC0_COMPARE                    _ARR(unsigned, 0x4000b140)
+/* Registers */
+#define RTC0_INTENSET                   _REG(unsigned, 0x4000b304)
+#define RTC0_INTENCLR                   _REG(unsigned, 0x4000b308)
+#define RTC0_EVTENSET                   _REG(unsigned, 0x4000b344)
+#define RTC0_EVTENCLR                   _REG(unsigned, 0x4000b348)
+#define RTC0_COUNTER                    _REG(unsigned, 0x4000b504)
+#define RTC0_PRESCALER                  _REG(unsigned, 0x4000b508)
+#define RTC0_CC                         _ARR(unsigned, 0x4000b540)
+
+#define RTC1_START                      _REG(unsigned, 0x40011000)
+#define RTC1_STOP                       _REG(unsigned, 0x40011004)
+#define RTC1_CLEAR                      _REG(unsigned, 0x40011008)
+#define RTC1_TRIGOVRFLW                 _REG(unsigned, 0x4001100c)
+#define RTC1_OVRFLW                     _REG(unsigned, 0x40011104)
+#define RTC1_COMPARE                    _ARR(unsigned, 0x40011140)
+#define RTC1_INTENSET                   _REG(unsigned, 0x40011304)
+#define RTC1_INTENCLR                   _REG(unsigned, 0x40011308)
+#define RTC1_EVTENSET                   _REG(unsigned, 0x40011344)
+#define RTC1_EVTENCLR                   _REG(unsigned, 0x40011348)
+#define RTC1_COUNTER                    _REG(unsigned, 0x40011504)
+#define RTC1_PRESCALER                  _REG(unsigned, 0x40011508)
+#define RTC1_CC                         _ARR(unsigned, 0x40011540)
+
+
 /* Random Number Generator */
 
 /* Interrupts */
@@ -1355,6 +1430,16 @@ extern volatile struct _pwm * const PWM[];
 
 /* NVIC stuff */
 
+/* The kernel runs at priority KERNEL_PRIO, together with SVC, PendSV
+and every interrupt whose handler calls interrupt(), and it masks them
+by setting BASEPRI rather than PRIMASK.  IRQs given a priority above
+the kernel with irq_urgent() are never masked, so their latency does
+not depend on what the kernel is doing; but their handlers must not
+call interrupt() or anything else in micro:bian. */
+#define KERNEL_PRIO 0x80
+#define N_URGENT 4              /* Urgent levels 0x00, 0x20, 0x40, 0x60 */
+#define URGENT_PRIO(level) ((level) << 5)
+
 /* irq_priority -- set priority of an IRQ from 0 (highest) to 255 */
 void irq_priority(int irq, unsigned priority);
 
@@ -1425,15 +1510,23 @@ typedef unsigned image[NIMG];
 #define led_off()   GPIO0_OUTCLR = LED_MASK0, GPIO1_OUTCLR = LED_MASK1
 
 
-/* CODERAM -- mark function for copying to RAM */
-#define CODERAM  __attribute((noinline, section(".xram")))
-
-/* A few assembler macros for single instructions. */
-#define intr_disable()  asm volatile ("cpsid i")
-#define intr_enable()   asm volatile ("cpsie i")
+/* CODERAM -- mark function for copying to RAM with 'make RAMCODE=1'.
+Inline functions may be marked too, in case GCC decides not to inline
+them. */
+#ifdef RAMCODE
+#define CODERAM  __attribute((section(".xram")))
+#else
+#define CODERAM
+#endif
+
+/* A few assembler macros for single instructions.  Interrupts are
+disabled by raising BASEPRI to KERNEL_PRIO, so urgent ones are still
+taken; get_primask and set_primask save and restore BASEPRI. */
+#define intr_disable()  asm volatile ("msr basepri, %0" : : "r"(KERNEL_PRIO))
+#define intr_enable()   asm volatile ("msr basepri, %0" : : "r"(0))
 #define get_primask()   ({ unsigned x;                                   \
-                           asm volatile ("mrs %0, primask" : "=r"(x)); x; })
-#define set_primask(x)  asm volatile ("msr primask, %0" : : "r"(x))
+                           asm volatile ("mrs %0, basepri" : "=r"(x)); x; })
+#define set_primask(x)  asm volatile ("msr basepri, %0" : : "r"(x))
 #define nop()           asm volatile ("nop")
 
 /* pause() -- disabled on V2 owing to long wakeup time */